@@ -28,163 +28,3820 @@
 #include "Map.h"
 #include "ScriptMgr.h"
 #include "Language.h"
+#include "Log.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "AutoBalance.h"
-#include "ScriptMgrMacros.h"
 #include "Group.h"
 #include "Pet.h"
 
+// AutoBalance.Perf.Enable, read from the current config snapshot
+bool IsPerfEnabled();
+
+enum ABPerfCounter
+{
+    AB_PERF_MODIFY_CALLS,
+    AB_PERF_RESCALES,
+    AB_PERF_DAMAGE_CALLS,
+    AB_PERF_DAMAGE_MODIFIED,
+    AB_PERF_IMMUNITIES,
+    AB_PERF_NOTIFICATIONS,
+    AB_PERF_HOOK_DISPATCHES,
+    // counted by the stats cache whether or not AutoBalance.Perf is enabled
+    AB_PERF_CACHE_HITS,
+    AB_PERF_CACHE_MISSES,
+    AB_PERF_CACHE_STORES,
+    MAX_AB_PERF_COUNTERS
+};
+
+enum ABPerfTimer
+{
+    AB_PERF_TIME_RESCALE,
+    AB_PERF_TIME_APPLY,
+    AB_PERF_TIME_HOOK_DISPATCH,
+    MAX_AB_PERF_TIMERS
+};
+
+// Prometheus names and help texts, in enum order
+static char const* const PerfCounterNames[MAX_AB_PERF_COUNTERS][2] =
+{
+    { "modify_calls", "Creature updates that reached ModifyCreatureAttributes on a scaled map" },
+    { "rescales", "Creature updates that went through a full rescale" },
+    { "damage_calls", "Damage and heal hook calls from units on a map with AutoBalance state" },
+    { "damage_modified", "Damage and heal hook calls that applied a damage multiplier" },
+    { "immunities", "Players and pets the immunities were applied to" },
+    { "notifications", "Notification packets sent to the players of a map" },
+    { "hook_dispatches", "Calls to the scripts registered with ABScriptMgr" },
+    { "stats_cache_hits", "Scaled stats found in the stats cache" },
+    { "stats_cache_misses", "Scaled stats looked up in the stats cache and not found" },
+    { "stats_cache_stores", "Scaled stats stored in the stats cache" },
+};
+
+static char const* const PerfTimerNames[MAX_AB_PERF_TIMERS][2] =
+{
+    { "rescale", "Time of the rescales on the map threads" },
+    { "apply", "Time setting the scaled stats on the creatures" },
+    { "hook_dispatch", "Time in the scripts registered with ABScriptMgr" },
+};
+
+// log2 buckets of nanoseconds: bucket i counts the times below 2^i ns, the last one everything
+static uint32 const AB_PERF_BUCKETS = 32;
+
+// Counters and latency histograms, as read from the threads or as one aggregate
+struct ABPerfValues
+{
+    uint64 counters[MAX_AB_PERF_COUNTERS] = {};
+    uint64 timeCount[MAX_AB_PERF_TIMERS] = {};
+    uint64 timeSum[MAX_AB_PERF_TIMERS] = {};
+    uint64 buckets[MAX_AB_PERF_TIMERS][AB_PERF_BUCKETS] = {};
+
+    void Add(ABPerfValues const& other, bool subtract = false)
+    {
+        for (uint32 i = 0; i < MAX_AB_PERF_COUNTERS; ++i)
+            counters[i] += subtract ? 0 - other.counters[i] : other.counters[i];
+
+        for (uint32 timer = 0; timer < MAX_AB_PERF_TIMERS; ++timer)
+        {
+            timeCount[timer] += subtract ? 0 - other.timeCount[timer] : other.timeCount[timer];
+            timeSum[timer] += subtract ? 0 - other.timeSum[timer] : other.timeSum[timer];
+            for (uint32 bucket = 0; bucket < AB_PERF_BUCKETS; ++bucket)
+                buckets[timer][bucket] += subtract ? 0 - other.buckets[timer][bucket] : other.buckets[timer][bucket];
+        }
+    }
+
+    // upper bound in ns of the bucket the percentile falls into
+    uint64 GetPercentile(ABPerfTimer timer, uint32 percentile) const
+    {
+        uint64 rank = (timeCount[timer] * percentile + 99) / 100;
+        uint64 seen = 0;
+        for (uint32 bucket = 0; bucket < AB_PERF_BUCKETS; ++bucket)
+        {
+            seen += buckets[timer][bucket];
+            if (rank && seen >= rank)
+                return uint64(1) << bucket;
+        }
+
+        return 0;
+    }
+};
+
+// The counters of one thread. Only that thread writes them, so they are plain loads and
+// stores without a lock prefix, atomic only so that the aggregation may read them any time.
+class ABPerfThreadBlock
+{
+public:
+    void Add(ABPerfCounter counter, uint64 value)
+    {
+        Increase(_counters[counter], value);
+    }
+
+    void Record(ABPerfTimer timer, uint64 nanoseconds)
+    {
+        uint32 bucket = 0;
+        while (bucket < AB_PERF_BUCKETS - 1 && (nanoseconds >> bucket))
+            ++bucket;
+
+        Increase(_timeCount[timer], 1);
+        Increase(_timeSum[timer], nanoseconds);
+        Increase(_buckets[timer][bucket], 1);
+    }
+
+    void Read(ABPerfValues& values) const
+    {
+        for (uint32 i = 0; i < MAX_AB_PERF_COUNTERS; ++i)
+            values.counters[i] += _counters[i].load(std::memory_order_relaxed);
+
+        for (uint32 timer = 0; timer < MAX_AB_PERF_TIMERS; ++timer)
+        {
+            values.timeCount[timer] += _timeCount[timer].load(std::memory_order_relaxed);
+            values.timeSum[timer] += _timeSum[timer].load(std::memory_order_relaxed);
+            for (uint32 bucket = 0; bucket < AB_PERF_BUCKETS; ++bucket)
+                values.buckets[timer][bucket] += _buckets[timer][bucket].load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static void Increase(std::atomic<uint64>& value, uint64 amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64> _counters[MAX_AB_PERF_COUNTERS] = {};
+    std::atomic<uint64> _timeCount[MAX_AB_PERF_TIMERS] = {};
+    std::atomic<uint64> _timeSum[MAX_AB_PERF_TIMERS] = {};
+    std::atomic<uint64> _buckets[MAX_AB_PERF_TIMERS][AB_PERF_BUCKETS] = {};
+};
+
+// AutoBalance.Perf: the blocks of all threads, summed up on demand. The blocks are never
+// written by anyone else, so a reset only moves the baseline that is subtracted
+class ABPerf
+{
+public:
+    void Add(ABPerfCounter counter, uint64 value = 1) { GetBlock().Add(counter, value); }
+    void Record(ABPerfTimer timer, uint64 nanoseconds) { GetBlock().Record(timer, nanoseconds); }
+
+    ABPerfValues Collect()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        ABPerfValues values = ReadBlocks();
+        values.Add(_baseline, true);
+        return values;
+    }
+
+    void Reset()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _baseline = ReadBlocks();
+    }
+
+    // everything counted since startup, Reset does not apply
+    ABPerfValues CollectTotals()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        return ReadBlocks();
+    }
+
+    uint32 GetThreadCount()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        return uint32(_blocks.size());
+    }
+
+private:
+    ABPerfThreadBlock& GetBlock()
+    {
+        // blocks are kept until shutdown, the counts of finished threads still add up
+        thread_local ABPerfThreadBlock* block = nullptr;
+        if (!block)
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _blocks.emplace_back(new ABPerfThreadBlock());
+            block = _blocks.back().get();
+        }
+
+        return *block;
+    }
+
+    ABPerfValues ReadBlocks() const
+    {
+        ABPerfValues values;
+        for (std::unique_ptr<ABPerfThreadBlock> const& block : _blocks)
+            block->Read(values);
+
+        return values;
+    }
+
+    std::mutex _lock;
+    std::vector<std::unique_ptr<ABPerfThreadBlock>> _blocks;
+    ABPerfValues _baseline;
+};
+
+static ABPerf Perf;
+
+// The counters and time of one map, next to the global ones. Written by the map thread,
+// read and reset by the perf command
+struct ABPerfMapStats
+{
+    std::atomic<uint64> counters[MAX_AB_PERF_COUNTERS] = {};
+    std::atomic<uint64> timeSum[MAX_AB_PERF_TIMERS] = {};
+
+    void Reset()
+    {
+        for (std::atomic<uint64>& counter : counters)
+            counter.store(0, std::memory_order_relaxed);
+        for (std::atomic<uint64>& time : timeSum)
+            time.store(0, std::memory_order_relaxed);
+    }
+};
+
+// counts globally and, if there is one, for the map
+inline void CountPerf(ABPerfMapStats* mapStats, ABPerfCounter counter, uint64 value = 1)
+{
+    Perf.Add(counter, value);
+    if (mapStats)
+        mapStats->counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+// times its scope when the instrumentation is enabled, otherwise it does not read the clock
+class ABPerfScope
+{
+public:
+    explicit ABPerfScope(ABPerfTimer timer, ABPerfMapStats* mapStats = nullptr) : _timer(timer), _mapStats(mapStats), _enabled(IsPerfEnabled())
+    {
+        if (_enabled)
+            _start = std::chrono::steady_clock::now();
+    }
+
+    ~ABPerfScope()
+    {
+        if (!_enabled)
+            return;
+
+        uint64 elapsed = uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+        Perf.Record(_timer, elapsed);
+        if (_mapStats)
+            _mapStats->timeSum[_timer].fetch_add(elapsed, std::memory_order_relaxed);
+    }
+
+private:
+    ABPerfTimer _timer;
+    ABPerfMapStats* _mapStats;
+    bool _enabled;
+    std::chrono::steady_clock::time_point _start;
+};
+
+enum ABTraceType
+{
+    AB_TRACE_ROSTER,
+    AB_TRACE_RESCALE,
+    AB_TRACE_APPLY,
+    AB_TRACE_APPLY_RESULTS,
+    AB_TRACE_NOTIFY,
+    MAX_AB_TRACE_TYPES
+};
+
+// event names and the name of their argument, in enum order
+static char const* const TraceTypeNames[MAX_AB_TRACE_TYPES][2] =
+{
+    { "roster change", "players" },
+    { "rescale", "entry" },
+    { "apply", "entry" },
+    { "apply worker results", "results" },
+    { "notifications", "messages" },
+};
+
+static uint32 const AB_TRACE_ALL_MAPS = 0xFFFFFFFF;
+
+// Records timed spans of the map threads into a ring buffer and writes them to a Chrome trace
+// event (Perfetto) JSON file from its own thread. Recording is one relaxed load while off; a
+// map thread never waits, it claims the next slot and overwrites the oldest event if the
+// writer has fallen behind. Slots are guarded by a sequence number like the stats cache, so
+// the writer can tell overwritten events apart and count them as dropped. A map thread takes
+// its slot with a compare-exchange and drops its event if a thread a buffer lap away still
+// holds it, so two events are never mixed.
+class ABTraceRecorder
+{
+public:
+    ~ABTraceRecorder()
+    {
+        Shutdown();
+    }
+
+    // map ids a recording can be started for, next to AB_TRACE_ALL_MAPS
+    static bool IsValidMapId(uint64 mapId) { return mapId < NotRecording; }
+
+    bool IsRecording(uint32 mapId) const
+    {
+        uint32 filter = _filter.load(std::memory_order_acquire);
+        return filter != NotRecording && (filter == AB_TRACE_ALL_MAPS || filter == mapId);
+    }
+
+    void Record(ABTraceType type, uint32 mapId, uint32 instanceId, uint32 arg, std::chrono::steady_clock::time_point start)
+    {
+        auto now = std::chrono::steady_clock::now();
+        uint64 index = _head.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = _slots[index & _mask];
+
+        // never take a slot that is being written or holds a newer event
+        uint64 sequence = slot.sequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) || sequence > index * 2 || !slot.sequence.compare_exchange_strong(sequence, index * 2 + 1, std::memory_order_acquire))
+            return;
+
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.words[0].store(uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count()), std::memory_order_relaxed);
+        slot.words[1].store(uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count()), std::memory_order_relaxed);
+        slot.words[2].store(uint64(mapId) << 32 | instanceId, std::memory_order_relaxed);
+        slot.words[3].store(uint64(type) << 32 | arg, std::memory_order_relaxed);
+        slot.sequence.store(index * 2 + 2, std::memory_order_release);
+    }
+
+    // the buffer size is only taken from the first recording, the slots are never released
+    // because a map thread may still be writing to one after the recording has stopped
+    bool Start(uint32 mapId, uint32 bufferSize, std::string const& fileName, std::string& error)
+    {
+        if (mapId != AB_TRACE_ALL_MAPS && !IsValidMapId(mapId))
+        {
+            error = "invalid map id";
+            return false;
+        }
+
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_filter.load(std::memory_order_relaxed) != NotRecording || _file.is_open())
+        {
+            error = "a trace is already being recorded or written";
+            return false;
+        }
+
+        _file.open(fileName, std::ios::trunc);
+        if (!_file)
+        {
+            error = "could not open " + fileName;
+            return false;
+        }
+
+        if (!_slots)
+        {
+            uint32 size = 1024;
+            while (size < std::min(bufferSize, MaxBufferSize))
+                size *= 2;
+
+            _slots.reset(new Slot[size]);
+            _mask = size - 1;
+        }
+
+        _fileName = fileName;
+        _tail = _head.load(std::memory_order_acquire);
+        _start = std::chrono::steady_clock::now();
+        _firstEvent = true;
+        written = 0;
+        dropped = 0;
+        _file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+        if (!_thread.joinable())
+            _thread = std::thread(&ABTraceRecorder::Run, this);
+
+        _filter.store(mapId, std::memory_order_release);
+        return true;
+    }
+
+    // the writer drains what is left and closes the file on its own
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (_filter.load(std::memory_order_relaxed) == NotRecording)
+                return;
+
+            _filter.store(NotRecording, std::memory_order_relaxed);
+            _closing = true;
+        }
+
+        _condition.notify_one();
+    }
+
+    void Shutdown()
+    {
+        Stop();
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _shutdown = true;
+        }
+
+        _condition.notify_one();
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    bool IsWriting()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _file.is_open();
+    }
+
+    uint32 GetFilter() const { return _filter.load(std::memory_order_relaxed); }
+    uint32 GetBufferSize() const { return _slots ? _mask + 1 : 0; }
+
+    std::string GetFileName()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _fileName;
+    }
+
+    // of the current or last recording
+    std::atomic<uint64> written{0};
+    std::atomic<uint64> dropped{0};
+
+private:
+    static uint32 const NotRecording = 0xFFFFFFFE;
+    static uint32 const MaxBufferSize = 1 << 22;
+
+    struct Slot
+    {
+        std::atomic<uint64> sequence{0};
+        std::atomic<uint64> words[4];
+    };
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        while (!_shutdown || _file.is_open())
+        {
+            _condition.wait_for(guard, std::chrono::milliseconds(250));
+            if (!_file.is_open())
+                continue;
+
+            Drain();
+
+            if (_closing || _shutdown)
+            {
+                // whatever is still being written when the recording stops is lost
+                dropped.fetch_add(_head.load(std::memory_order_acquire) - _tail, std::memory_order_relaxed);
+                _tail = _head.load(std::memory_order_relaxed);
+                _file << "],\"otherData\":{\"droppedEvents\":\"" << dropped.load(std::memory_order_relaxed) << "\"}}\n";
+                _file.close();
+                _closing = false;
+                sLog->outString("AutoBalance: trace %s written, %llu events, %llu dropped.", _fileName.c_str(),
+                    (unsigned long long)written.load(std::memory_order_relaxed), (unsigned long long)dropped.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    // called with the lock held, only blocks the commands and never a map thread
+    void Drain()
+    {
+        uint64 head = _head.load(std::memory_order_acquire);
+        if (head - _tail > _mask + 1)
+        {
+            dropped.fetch_add(head - _tail - (_mask + 1), std::memory_order_relaxed);
+            _tail = head - (_mask + 1);
+        }
+
+        for (; _tail < head; ++_tail)
+        {
+            Slot const& slot = _slots[_tail & _mask];
+            uint64 sequence = slot.sequence.load(std::memory_order_acquire);
+
+            // still being written, the next drain continues here. An event that is still missing
+            // one drain later was dropped by its map thread or is stuck, and is skipped
+            if (sequence < _tail * 2 + 2)
+            {
+                if (_stalledTail != _tail)
+                {
+                    _stalledTail = _tail;
+                    break;
+                }
+
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            uint64 words[4];
+            for (uint32 i = 0; i < 4; ++i)
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence != _tail * 2 + 2 || slot.sequence.load(std::memory_order_relaxed) != sequence)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            WriteEvent(words);
+        }
+
+        _file.flush();
+    }
+
+    void WriteEvent(uint64 const (&words)[4])
+    {
+        uint64 startNs = uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(_start.time_since_epoch()).count());
+        uint32 type = std::min(uint32(words[3] >> 32), uint32(MAX_AB_TRACE_TYPES - 1));
+
+        // maps are processes and instances threads, so each instance gets its own track
+        char line[256];
+        snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"cat\":\"autobalance\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"%s\":%u}}",
+            _firstEvent ? "" : ",", TraceTypeNames[type][0], (double(words[0]) - double(startNs)) / 1000.0, double(words[1]) / 1000.0,
+            uint32(words[2] >> 32), uint32(words[2]), TraceTypeNames[type][1], uint32(words[3]));
+
+        _file << line;
+        _firstEvent = false;
+        written.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint32> _filter{NotRecording};
+    std::atomic<uint64> _head{0};
+    std::unique_ptr<Slot[]> _slots;
+    uint64 _mask = 0;
+
+    std::thread _thread;
+    std::mutex _lock;
+    std::condition_variable _condition;
+    std::ofstream _file;
+    std::string _fileName;
+    std::chrono::steady_clock::time_point _start;
+    uint64 _tail = 0;
+    // where the last drain stopped for a missing event
+    uint64 _stalledTail = ~uint64(0);
+    bool _firstEvent = true;
+    bool _closing = false;
+    bool _shutdown = false;
+};
+
+static ABTraceRecorder TraceRecorder;
+
+// records its scope as a span if the map is being traced
+class ABTraceScope
+{
+public:
+    ABTraceScope(ABTraceType type, Map const* map, uint32 arg) : _type(type), _map(map), _arg(arg), _enabled(TraceRecorder.IsRecording(map->GetId()))
+    {
+        if (_enabled)
+            _start = std::chrono::steady_clock::now();
+    }
+
+    ~ABTraceScope()
+    {
+        if (_enabled)
+            TraceRecorder.Record(_type, _map->GetId(), _map->GetInstanceId(), _arg, _start);
+    }
+
+    // for arguments only known at the end, like the size of a burst
+    void SetArg(uint32 arg) { _arg = arg; }
+
+private:
+    ABTraceType _type;
+    Map const* _map;
+    uint32 _arg;
+    bool _enabled;
+    std::chrono::steady_clock::time_point _start;
+};
+
+// Highest AutoBalance.DebugLevel the logging macros are compiled in for, see AB_LOG_ERROR
+#ifndef AB_LOG_MAX_LEVEL
+#define AB_LOG_MAX_LEVEL 3
+#endif
+
+// Deferred log arguments are numbers only: a string could be gone before it is formatted
+template<class T>
+uint64 PackLogArg(T value, std::false_type /*floating*/)
+{
+    static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "AutoBalance log arguments must be numbers");
+    return uint64(value);
+}
+
+inline uint64 PackLogArg(double value, std::true_type /*floating*/)
+{
+    uint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+template<class T>
+T UnpackLogArg(uint64 bits, std::false_type /*floating*/)
+{
+    return T(bits);
+}
+
+template<class T>
+double UnpackLogArg(uint64 bits, std::true_type /*floating*/)
+{
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+template<class... Args, size_t... I>
+void FormatLogArgs(char* buffer, size_t size, char const* format, uint64 const* args, std::index_sequence<I...>)
+{
+    snprintf(buffer, size, format, UnpackLogArg<Args>(args[I], std::is_floating_point<Args>())...);
+}
+
+// instantiated for the argument types of each call, so the log thread can format them later
+template<class... Args>
+void FormatLog(char* buffer, size_t size, char const* format, uint64 const* args)
+{
+    FormatLogArgs<Args...>(buffer, size, format, args, std::index_sequence_for<Args...>());
+}
+
+typedef void (*ABLogFormatter)(char* buffer, size_t size, char const* format, uint64 const* args);
+
+// Log messages of the map and worker threads, formatted and written to the server log by a
+// thread of its own. Producers take a slot of a bounded lock-free queue (sequence per slot);
+// if it is full the message is dropped and counted, a map thread never waits.
+class ABLogQueue
+{
+public:
+    static uint32 const MaxArgs = 8;
+    static uint32 const Size = 4096;
+
+    ABLogQueue()
+    {
+        for (uint32 i = 0; i < Size; ++i)
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~ABLogQueue()
+    {
+        Stop();
+    }
+
+    template<class... Args>
+    void Push(uint8 level, char const* format, Args... args)
+    {
+        static_assert(sizeof...(Args) <= MaxArgs, "too many AutoBalance log arguments");
+        uint64 packed[MaxArgs + 1] = { PackLogArg(args, std::is_floating_point<Args>())... };
+
+        uint64 position = _enqueue.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true)
+        {
+            slot = &_slots[position % Size];
+            int64 diff = int64(slot->sequence.load(std::memory_order_acquire)) - int64(position);
+            if (diff == 0)
+            {
+                if (_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+                position = _enqueue.load(std::memory_order_relaxed);
+        }
+
+        slot->level = level;
+        slot->format = format;
+        slot->formatter = &FormatLog<Args...>;
+        std::copy(packed, packed + MaxArgs, slot->args);
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    void Start()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (!_thread.joinable() && !_stopped)
+            _thread = std::thread(&ABLogQueue::Run, this);
+    }
+
+    // writes what is queued before it returns
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stopped = true;
+        }
+
+        _condition.notify_one();
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    std::atomic<uint64> dropped{0};
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64> sequence;
+        uint8 level;
+        char const* format;
+        ABLogFormatter formatter;
+        uint64 args[MaxArgs];
+    };
+
+    void Run()
+    {
+        uint64 reportedDrops = 0;
+        std::unique_lock<std::mutex> guard(_lock);
+        while (true)
+        {
+            // producers do not notify, that could make them wait for the scheduler
+            _condition.wait_for(guard, std::chrono::milliseconds(100));
+            bool stopped = _stopped;
+
+            guard.unlock();
+            Drain();
+
+            uint64 drops = dropped.load(std::memory_order_relaxed);
+            if (drops != reportedDrops)
+            {
+                sLog->outError("AutoBalance: %llu log messages dropped, the log queue was full.", (unsigned long long)(drops - reportedDrops));
+                reportedDrops = drops;
+            }
+
+            guard.lock();
+            if (stopped)
+                return;
+        }
+    }
+
+    void Drain()
+    {
+        char message[512];
+        while (true)
+        {
+            Slot& slot = _slots[_dequeue % Size];
+            if (slot.sequence.load(std::memory_order_acquire) != _dequeue + 1)
+                return;
+
+            slot.formatter(message, sizeof(message), slot.format, slot.args);
+            if (slot.level <= 1)
+                sLog->outError("%s", message);
+            else
+                sLog->outString("%s", message);
+
+            slot.sequence.store(_dequeue + Size, std::memory_order_release);
+            ++_dequeue;
+        }
+    }
+
+    Slot _slots[Size];
+    std::atomic<uint64> _enqueue{0};
+    // only used by the log thread
+    uint64 _dequeue = 0;
+
+    std::thread _thread;
+    std::mutex _lock;
+    std::condition_variable _condition;
+    bool _stopped = false;
+};
+
+static ABLogQueue LogQueue;
+
+// The level is checked against the cached AutoBalance.DebugLevel of the config snapshot, the
+// arguments are only evaluated if it passes. The format is checked by the compiler through the
+// dead printf. Levels above AB_LOG_MAX_LEVEL compile to nothing.
+#define AB_LOG(level, ...) \
+    do \
+    { \
+        if ((level) <= GetConfig().DebugLevel) \
+            LogQueue.Push((level), __VA_ARGS__); \
+        if (false) \
+            printf(__VA_ARGS__); \
+    } while (0)
+
+#if AB_LOG_MAX_LEVEL >= 1
+#define AB_LOG_ERROR(...) AB_LOG(1, __VA_ARGS__)
+#else
+#define AB_LOG_ERROR(...) do { } while (0)
+#endif
+
+#if AB_LOG_MAX_LEVEL >= 2
+#define AB_LOG_INFO(...) AB_LOG(2, __VA_ARGS__)
+#else
+#define AB_LOG_INFO(...) do { } while (0)
+#endif
+
+#if AB_LOG_MAX_LEVEL >= 3
+#define AB_LOG_DEBUG(...) AB_LOG(3, __VA_ARGS__)
+#else
+#define AB_LOG_DEBUG(...) do { } while (0)
+#endif
+
+void ABScriptMgr::AddScript(ABModuleScript* script, uint32 hooks)
+{
+    for (uint32 hook = 0; hook < AB_HOOK_COUNT; ++hook)
+        if (hooks & (1 << hook))
+            _scripts[hook].push_back(script);
+}
+
+bool ABScriptMgr::Dispatch(ABHook hook, ABScalingContext& context)
+{
+    ABPerfScope perfScope(AB_PERF_TIME_HOOK_DISPATCH);
+    if (IsPerfEnabled())
+        Perf.Add(AB_PERF_HOOK_DISPATCHES);
+
+    bool ret = true;
+    for (ABModuleScript* script : _scripts[hook])
+    {
+        bool result = true;
+        switch (hook)
+        {
+            case AB_HOOK_BEFORE_MODIFY_ATTRIBUTES: result = script->OnScalingStart(context); break;
+            case AB_HOOK_AFTER_DEFAULT_MULTIPLIER: result = script->OnScalingMultiplier(context); break;
+            case AB_HOOK_BEFORE_UPDATE_STATS: result = script->OnScalingStats(context); break;
+            default: break;
+        }
+
+        if (!result)
+            ret = false; // we change ret value only when scripts return false
+    }
+
+    return ret;
+}
+
 bool ABScriptMgr::OnBeforeModifyAttributes(Creature *creature, uint32 & instancePlayerCount) {
-    bool ret=true;
-    FOR_SCRIPTS_RET(ABModuleScript, itr, end, ret) // return true by default if not scripts
-        if (!itr->second->OnBeforeModifyAttributes(creature, instancePlayerCount))
-            ret=false; // we change ret value only when scripts return false
+    ABScalingContext context;
+    context.creature = creature;
+    context.instancePlayerCount = instancePlayerCount;
+    bool ret = OnScalingStart(context);
+    instancePlayerCount = context.instancePlayerCount;
+    return ret;
+}
+
+bool ABScriptMgr::OnAfterDefaultMultiplier(Creature *creature, float & defaultMultiplier) {
+    ABScalingContext context;
+    context.creature = creature;
+    context.defaultMultiplier = defaultMultiplier;
+    bool ret = OnScalingMultiplier(context);
+    defaultMultiplier = context.defaultMultiplier;
+    return ret;
+}
+
+bool ABScriptMgr::OnBeforeUpdateStats(Creature* creature, uint32& scaledHealth, uint32& scaledMana, float& damageMultiplier, uint32& newBaseArmor) {
+    ABScalingContext context;
+    context.creature = creature;
+    context.scaledHealth = scaledHealth;
+    context.scaledMana = scaledMana;
+    context.damageMultiplier = damageMultiplier;
+    context.newBaseArmor = newBaseArmor;
+    bool ret = OnScalingStats(context);
+    scaledHealth = context.scaledHealth;
+    scaledMana = context.scaledMana;
+    damageMultiplier = context.damageMultiplier;
+    newBaseArmor = context.newBaseArmor;
+    return ret;
+}
+
+ABModuleScript::ABModuleScript(const char* name, uint32 hooks)
+    : ModuleScript(name)
+{
+    ScriptRegistry<ABModuleScript>::AddScript(this);
+    sABScriptMgr->AddScript(this, hooks);
+}
+
+
+// Selects which of the AutoBalance.InflectionPoint* settings applies to a map
+enum ABInflectionBucket
+{
+    AB_INFLECTION_DUNGEON = 0,
+    AB_INFLECTION_DUNGEON_HEROIC,
+    AB_INFLECTION_RAID10,
+    AB_INFLECTION_RAID10_HEROIC,
+    AB_INFLECTION_RAID25,
+    AB_INFLECTION_RAID25_HEROIC,
+    AB_INFLECTION_RAID,
+    AB_INFLECTION_RAID_HEROIC,
+    MAX_AB_INFLECTION_BUCKETS
+};
+
+// AutoBalance.InflectionPoint* per bucket and AutoBalance.BossInflectionMult
+struct ABInflectionConfig
+{
+    float points[MAX_AB_INFLECTION_BUCKETS];
+    float bossMultiplier;
+};
+
+// Everything the scaling needs to know about a map that does not change during its
+// lifetime, built once when the map is created instead of on every rescale
+struct ABMapContext
+{
+    void Init(Map const* map);
+    // level range of the dungeon or area, 0 if unknown
+    void GetAreaLevel(uint32 areaId, uint8& min, uint8& max);
+
+    bool initialized = false;
+    bool isDungeon = false;
+    bool isRaid = false;
+    bool isHeroic = false;
+    bool isBattleground = false;
+    uint32 maxPlayers = 0;
+    ABInflectionBucket inflectionBucket = AB_INFLECTION_DUNGEON;
+    // LFG dungeon level range, takes precedence over the area levels
+    uint8 lfgMinLevel = 0;
+    uint8 lfgMaxLevel = 0;
+    // area id -> area level, instances only span a handful of areas
+    std::vector<std::pair<uint32, uint8>> areaLevels;
+};
+
+// Players on a map, kept up to date by the enter/leave, level and combat hooks so the
+// counts and levels never require a walk over the map's player list. GMs are tracked
+// (they can toggle at any time) but not counted. Members are looked up by GUID. Only kept
+// on maps whose creatures are scaled, see GetRoster.
+class ABRoster
+{
+public:
+    void Add(Player* player)
+    {
+        if (Find(player))
+        {
+            Update(player);
+            return;
+        }
+
+        Member member;
+        member.player = player;
+        member.guid = player->GetGUID();
+        member.level = player->getLevel();
+        member.gameMaster = player->IsGameMaster();
+        member.inCombat = player->IsInCombat();
+        _index[member.guid] = uint32(_members.size());
+        _members.push_back(member);
+        Count(member, 1);
+    }
+
+    void Remove(Player* player)
+    {
+        auto itr = _index.find(player->GetGUID());
+        if (itr == _index.end())
+            return;
+
+        uint32 index = itr->second;
+        _index.erase(itr);
+        Count(_members[index], -1);
+
+        if (index + 1 != _members.size())
+        {
+            _members[index] = _members.back();
+            _index[_members[index].guid] = index;
+        }
+
+        _members.pop_back();
+    }
+
+    // picks up level and GM mode changes of a player already on the roster
+    void Update(Player* player)
+    {
+        if (Member* member = Find(player))
+            Set(*member, player->getLevel(), player->IsGameMaster(), member->inCombat);
+    }
+
+    void SetInCombat(Player* player, bool inCombat)
+    {
+        if (Member* member = Find(player))
+            Set(*member, player->getLevel(), player->IsGameMaster(), inCombat);
+    }
+
+    // empties the roster, it is no longer kept up to date until the next Rebuild
+    void Reset()
+    {
+        _members.clear();
+        _index.clear();
+        _levels.fill(0);
+        _playerCount = 0;
+        _inCombatCount = 0;
+        _maxLevel = 0;
+        _tracked = false;
+    }
+
+    // rebuilds the roster from scratch, used by the checkmap command and when a map gets scaled
+    void Rebuild(Map* map)
+    {
+        Reset();
+        _tracked = true;
+
+        Map::PlayerList const &playerList = map->GetPlayers();
+        for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
+            if (Player* playerHandle = playerIteration->GetSource())
+                Add(playerHandle);
+    }
+
+    bool IsTracked() const { return _tracked; }
+    uint32 GetPlayerCount() const { return _playerCount; }
+    uint32 GetInCombatCount() const { return _inCombatCount; }
+    uint8 GetMaxLevel() const { return _maxLevel; }
+
+    bool IsNearPlayer(WorldObject const* object, float distance) const
+    {
+        for (Member const& member : _members)
+            if (!member.gameMaster && member.player->IsWithinDist(object, distance))
+                return true;
+
+        return false;
+    }
+
+    // lowest level that at least percent % of the players are at or below, 50 = median
+    uint8 GetLevelPercentile(uint32 percent) const
+    {
+        if (!_playerCount)
+            return 0;
+
+        uint32 rank = std::max<uint32>(1, (_playerCount * std::min<uint32>(percent, 100) + 99) / 100);
+        uint32 seen = 0;
+        for (uint32 level = 0; level < _maxLevel; ++level)
+        {
+            seen += _levels[level];
+            if (seen >= rank)
+                return uint8(level);
+        }
+
+        return _maxLevel;
+    }
+
+private:
+    struct Member
+    {
+        Player* player;
+        uint64 guid;
+        uint8 level;
+        bool gameMaster;
+        bool inCombat;
+    };
+
+    Member* Find(Player* player)
+    {
+        auto itr = _index.find(player->GetGUID());
+        return itr != _index.end() ? &_members[itr->second] : nullptr;
+    }
+
+    void Set(Member& member, uint8 level, bool gameMaster, bool inCombat)
+    {
+        if (member.level == level && member.gameMaster == gameMaster && member.inCombat == inCombat)
+            return;
+
+        Count(member, -1);
+        member.level = level;
+        member.gameMaster = gameMaster;
+        member.inCombat = inCombat;
+        Count(member, 1);
+    }
+
+    void Count(Member const& member, int32 delta)
+    {
+        if (member.gameMaster)
+            return;
+
+        _playerCount += delta;
+        if (member.inCombat)
+            _inCombatCount += delta;
+
+        _levels[member.level] += delta;
+        if (delta > 0)
+            _maxLevel = std::max(_maxLevel, member.level);
+        else
+            // the histogram makes this correct when the highest level player leaves
+            while (_maxLevel && !_levels[_maxLevel])
+                --_maxLevel;
+    }
+
+    std::vector<Member> _members;
+    // player GUID -> position in _members
+    std::unordered_map<uint64, uint32> _index;
+    // non-GM players per level
+    std::array<uint16, 256> _levels{};
+    uint32 _playerCount = 0;
+    uint32 _inCombatCount = 0;
+    uint8 _maxLevel = 0;
+    bool _tracked = false;
+};
+
+// Map wide notifications waiting to be sent. Messages queued in a burst are merged into
+// one chat line, duplicates are dropped and only the newest MaxMessages are kept.
+class ABNotifier
+{
+public:
+    static constexpr size_t MaxMessages = 8;
+
+    // returns true if this made the notifier pending
+    bool Queue(std::string const& message, uint32 now)
+    {
+        if (std::find(_messages.begin(), _messages.end(), message) != _messages.end())
+            return false;
+
+        bool wasEmpty = _messages.empty();
+        if (wasEmpty)
+            _firstQueued = now;
+        else if (_messages.size() >= MaxMessages)
+        {
+            _messages.erase(_messages.begin());
+            ++_dropped;
+        }
+
+        _messages.push_back(message);
+        return wasEmpty;
+    }
+
+    bool IsPending() const { return !_messages.empty(); }
+    uint32 GetPendingCount() const { return uint32(_messages.size()) + _dropped; }
+
+    // true once the burst window has passed and the last message is old enough
+    bool IsDue(uint32 now, uint32 mergeWindow, uint32 minInterval) const
+    {
+        return IsPending() && getMSTimeDiff(_firstQueued, now) >= mergeWindow
+            && (!_sent || getMSTimeDiff(_lastSent, now) >= minInterval);
+    }
+
+    // joins the pending messages into one line and clears them
+    std::string Take(uint32 now)
+    {
+        std::string text = "|cffFF0000 [AutoBalance]|r|cffFF8000 ";
+        if (_dropped)
+            text += std::to_string(_dropped) + " older notifications skipped; ";
+
+        for (size_t i = 0; i < _messages.size(); ++i)
+        {
+            if (i)
+                text += "; ";
+            text += _messages[i];
+        }
+        text += " |r";
+
+        _messages.clear();
+        _dropped = 0;
+        _lastSent = now;
+        _sent = true;
+        return text;
+    }
+
+private:
+    std::vector<std::string> _messages;
+    uint32 _dropped = 0;
+    uint32 _firstQueued = 0;
+    uint32 _lastSent = 0;
+    bool _sent = false;
+};
+
+// Creature rescales of a map in the current update and the progress of the current
+// rescale wave, i.e. everything that gets rescaled after a player count or level change.
+// A wave ends with the first update that did not have to defer a creature.
+class ABRescaleBudget
+{
+public:
+    // creatures in combat are never deferred, creatures near a player may use the whole
+    // budget and the others only half of it, so the ones that matter come first
+    bool IsSpent(bool nearPlayer, uint32 maxCreatures, uint32 maxMicroseconds) const
+    {
+        uint32 divisor = nearPlayer ? 1 : 2;
+        return (maxCreatures && _creatures >= maxCreatures / divisor)
+            || (maxMicroseconds && _microseconds >= maxMicroseconds / divisor);
+    }
+
+    // returns true if this started a new wave
+    bool AddRescale(uint32 microseconds, uint32 now)
+    {
+        bool started = !_inWave;
+        if (started)
+        {
+            _inWave = true;
+            _waveStart = now;
+            _waveCreatures = 0;
+            _waveUpdates = 0;
+        }
+
+        ++_creatures;
+        ++_waveCreatures;
+        _microseconds += microseconds;
+        return started;
+    }
+
+    void Defer() { ++_deferred; }
+
+    // called once per map update, returns true if this ended the wave
+    bool EndUpdate(uint32 now)
+    {
+        backlog = _deferred;
+        peakBacklog = std::max(peakBacklog, backlog);
+
+        bool ended = false;
+        if (_inWave)
+        {
+            ++_waveUpdates;
+
+            if (!_deferred)
+            {
+                _inWave = false;
+                lastWaveDuration = getMSTimeDiff(_waveStart, now);
+                lastWaveCreatures = _waveCreatures;
+                lastWaveUpdates = _waveUpdates;
+                ended = true;
+            }
+        }
+
+        _creatures = 0;
+        _microseconds = 0;
+        _deferred = 0;
+        return ended;
+    }
+
+    bool IsInWave() const { return _inWave; }
+
+    // creatures deferred in the last update
+    uint32 backlog = 0;
+    uint32 peakBacklog = 0;
+    // time, creatures and map updates the last complete wave took
+    uint32 lastWaveDuration = 0;
+    uint32 lastWaveCreatures = 0;
+    uint32 lastWaveUpdates = 0;
+
+private:
+    uint32 _creatures = 0;
+    uint32 _microseconds = 0;
+    uint32 _deferred = 0;
+    bool _inWave = false;
+    uint32 _waveStart = 0;
+    uint32 _waveCreatures = 0;
+    uint32 _waveUpdates = 0;
+};
+
+class AutoBalanceMapInfo;
+
+// Config generations a creature has been scaled with: the last change of the settings that
+// apply to all maps, of its map's inflection bucket and of its entry's overrides. A config
+// reload only rescales the creatures whose stamp it changes.
+struct ABConfigStamp
+{
+    uint32 scaling = 0;
+    uint32 bucket = 0;
+    uint32 entry = 0;
+
+    bool operator==(ABConfigStamp const& other) const
+    {
+        return scaling == other.scaling && bucket == other.bucket && entry == other.entry;
+    }
+
+    bool operator!=(ABConfigStamp const& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// Scaling state of one creature, kept in the ABCreaturePool of its map. Packed without
+// virtuals, the members are ordered by size.
+class AutoBalanceCreatureInfo
+{
+public:
+    // scaling generation (see GetScalingGeneration) this creature has been evaluated at, 0 = never
+    uint32 generation = 0;
+    ABConfigStamp configStamp;
+    uint32 instancePlayerCount = 0;
+    // this is used to detect creatures that update their entry
+    uint32 entry = 0;
+    float DamageMultiplier = 1;
+    float HealthMultiplier = 1;
+    float ManaMultiplier = 1;
+    float ArmorMultiplier = 1;
+    // values the last rescale has set on the creature, only valid while applied is set
+    uint32 appliedHealth = 0;
+    uint32 appliedMana = 0;
+    uint32 appliedArmor = 0;
+    uint8 selectedLevel = 0;
+    // set once the stats have been scaled with a damage multiplier other than 1
+    bool scaled = false;
+    bool applied = false;
+    // the stats of the last evaluation are computed by the rescale workers, not applied yet
+    bool asyncPending = false;
+};
+
+// memory and entries of the creature pools of all maps, see .autobalance mapstat
+static std::atomic<uint64> CreaturePoolBytes(0);
+static std::atomic<uint32> CreaturePoolEntries(0);
+
+// Per map storage of the creature scaling state. Entries live in slabs of SlabSize, so their
+// address never changes, and are found by the creature GUID through an open addressing index.
+// There is no hook for a creature leaving the map: the entries of creatures that are gone are
+// swept before the pool grows, and everything is released at once when the map unloads.
+class ABCreaturePool
+{
+public:
+    static uint32 const SlabSize = 256;
+
+    ABCreaturePool() {}
+    ABCreaturePool(ABCreaturePool const&) = delete;
+    ABCreaturePool& operator=(ABCreaturePool const&) = delete;
+
+    ~ABCreaturePool()
+    {
+        CreaturePoolBytes.fetch_sub(_accountedBytes, std::memory_order_relaxed);
+        CreaturePoolEntries.fetch_sub(_used, std::memory_order_relaxed);
+    }
+
+    // returns nullptr for creatures that have neither been scaled nor disabled on this map
+    AutoBalanceCreatureInfo* Find(uint64 guid) const
+    {
+        if (_index.empty())
+            return nullptr;
+
+        uint32 mask = uint32(_index.size()) - 1;
+        for (uint32 slot = Hash(guid) & mask; ; slot = (slot + 1) & mask)
+        {
+            IndexEntry const& indexEntry = _index[slot];
+            if (indexEntry.guid == guid)
+                return &_slabs[indexEntry.index / SlabSize][indexEntry.index % SlabSize];
+
+            if (!indexEntry.guid)
+                return nullptr;
+        }
+    }
+
+    // the map is only used to check which creatures are still there when the pool is full
+    AutoBalanceCreatureInfo* Create(uint64 guid, Map* map)
+    {
+        if (_free.empty())
+            Reserve(map);
+
+        uint32 index = _free.back();
+        _free.pop_back();
+        Insert(guid, index);
+        ++_used;
+        CreaturePoolEntries.fetch_add(1, std::memory_order_relaxed);
+
+        AutoBalanceCreatureInfo* creatureABInfo = &_slabs[index / SlabSize][index % SlabSize];
+        *creatureABInfo = AutoBalanceCreatureInfo();
+        return creatureABInfo;
+    }
+
+    uint32 GetUsed() const { return _used; }
+    uint32 GetCapacity() const { return uint32(_slabs.size()) * SlabSize; }
+
+    size_t GetMemoryUsage() const
+    {
+        return _slabs.size() * SlabSize * sizeof(AutoBalanceCreatureInfo) + _slabs.capacity() * sizeof(_slabs[0])
+            + _index.capacity() * sizeof(IndexEntry) + _free.capacity() * sizeof(uint32);
+    }
+
+private:
+    // guid 0 marks an empty slot, no creature has it
+    struct IndexEntry
+    {
+        uint64 guid;
+        uint32 index;
+    };
+
+    static uint32 Hash(uint64 guid)
+    {
+        return uint32((guid * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+
+    void Reserve(Map* map)
+    {
+        if (_used)
+            Sweep(map);
+
+        // a pool that is mostly alive grows, so the sweeps stay rare
+        if (_free.empty() || _free.size() < GetCapacity() / 4)
+        {
+            uint32 first = GetCapacity();
+            _slabs.emplace_back(new AutoBalanceCreatureInfo[SlabSize]);
+
+            // handed out from the back, lowest index first
+            for (uint32 index = first + SlabSize; index > first; --index)
+                _free.push_back(index - 1);
+
+            Rebuild();
+        }
+
+        CreaturePoolBytes.fetch_add(GetMemoryUsage() - _accountedBytes, std::memory_order_relaxed);
+        _accountedBytes = GetMemoryUsage();
+    }
+
+    // releases the entries of the creatures that are no longer on the map
+    void Sweep(Map* map)
+    {
+        uint32 released = 0;
+        for (IndexEntry& indexEntry : _index)
+            if (indexEntry.guid && !map->GetCreature(indexEntry.guid))
+            {
+                _free.push_back(indexEntry.index);
+                indexEntry.guid = 0;
+                ++released;
+            }
+
+        _used -= released;
+        CreaturePoolEntries.fetch_sub(released, std::memory_order_relaxed);
+
+        if (released)
+            Rebuild();
+    }
+
+    // sized for the capacity at a load of at most one half
+    void Rebuild()
+    {
+        std::vector<IndexEntry> index;
+        index.swap(_index);
+
+        size_t size = 16;
+        while (size < GetCapacity() * 2)
+            size *= 2;
+
+        _index.assign(size, IndexEntry{ 0, 0 });
+        for (IndexEntry const& indexEntry : index)
+            if (indexEntry.guid)
+                Insert(indexEntry.guid, indexEntry.index);
+    }
+
+    void Insert(uint64 guid, uint32 index)
+    {
+        uint32 mask = uint32(_index.size()) - 1;
+        uint32 slot = Hash(guid) & mask;
+        while (_index[slot].guid)
+            slot = (slot + 1) & mask;
+
+        _index[slot].guid = guid;
+        _index[slot].index = index;
+    }
+
+    std::vector<std::unique_ptr<AutoBalanceCreatureInfo[]>> _slabs;
+    std::vector<IndexEntry> _index;
+    std::vector<uint32> _free;
+    uint32 _used = 0;
+    size_t _accountedBytes = 0;
+};
+
+struct ABRescaleResults;
+
+class AutoBalanceMapInfo : public DataMap::Base
+{
+public:
+    AutoBalanceMapInfo() {}
+    AutoBalanceMapInfo(uint32 count, uint8 selLevel) : playerCount(count),mapLevel(selLevel) {}
+    ~AutoBalanceMapInfo();
+
+    void SetPlayerCount(uint32 count)
+    {
+        if (playerCount == count)
+            return;
+
+        playerCount = count;
+        ++generation;
+    }
+
+    void SetMapLevel(uint8 level)
+    {
+        if (mapLevel == level)
+            return;
+
+        mapLevel = level;
+        ++generation;
+    }
+
+    uint32 playerCount = 0;
+    uint8 mapLevel = 0;
+    // bumped only when something the creature scaling depends on changes
+    uint32 generation = 0;
+    ABMapContext context;
+    // maintained even while the module is disabled, so it can be enabled at runtime
+    ABRoster roster;
+    // players that got a charm, fear or silence aura while the immunities are active,
+    // handled on the next map update
+    std::vector<Player*> pendingImmunityChecks;
+    // notifications for all players on the map, sent from OnMapUpdate
+    ABNotifier notifier;
+    // a player left during combat, the roster count and level are applied once nobody fights
+    bool rescalePending = false;
+    ABRescaleBudget rescaleBudget;
+    // config generation the player immunities of this dungeon are applied with, 0 = not a dungeon
+    uint32 immunityGeneration = 0;
+    // the creatures scaled on this map, released with it
+    ABCreaturePool creatures;
+    // AutoBalance.Perf, also counted by the damage hooks that only have a const map info
+    mutable ABPerfMapStats perf;
+    // rescales computed by the workers for this map, shared with them so a map can unload
+    // while some are still in flight. Created by the first asynchronous rescale
+    std::shared_ptr<ABRescaleResults> asyncResults;
+};
+
+// Accessor for the AutoBalance entries stored in DataMap containers. The key string is
+// built only once, and Find never creates a default entry for unrelated objects. Each thread
+// keeps a handle to the entry it resolved last, so the hooks of one object only hash the key
+// string once. Creating or destroying an entry invalidates the handles of all threads.
+template<class T>
+class ABDataKey
+{
+public:
+    explicit ABDataKey(char const* name) : _name(name) { }
+
+    // returns nullptr if there is no entry yet
+    T* Find(DataMap const& data) const
+    {
+        Handle& handle = GetHandle();
+        uint32 epoch = _epoch.load(std::memory_order_acquire);
+        if (handle.data != &data || handle.epoch != epoch)
+        {
+            handle.data = &data;
+            handle.epoch = epoch;
+            handle.value = data.Get<T>(_name);
+        }
+
+        return handle.value;
+    }
+
+    T* FindOrCreate(DataMap& data) const
+    {
+        if (T* value = Find(data))
+            return value;
+
+        T* value = data.GetDefault<T>(_name);
+        Invalidate();
+        return value;
+    }
+
+    // for the destructor of T, a new entry may get the address of the destroyed one
+    void Invalidate() const { _epoch.fetch_add(1, std::memory_order_release); }
+
+private:
+    struct Handle
+    {
+        DataMap const* data = nullptr;
+        uint32 epoch = 0;
+        T* value = nullptr;
+    };
+
+    static Handle& GetHandle()
+    {
+        thread_local Handle handle;
+        return handle;
+    }
+
+    std::string const _name;
+    mutable std::atomic<uint32> _epoch{0};
+};
+
+static ABDataKey<AutoBalanceMapInfo> const MapInfoKey("AutoBalanceMapInfo");
+
+struct ABCreatureOverride
+{
+    // -1 = not forced, 0 = scaling disabled (DisabledID), otherwise the ForcedIDXX player count
+    int32 forcedPlayerCount = -1;
+    float healthMultiplier = 1.0f;
+    float damageMultiplier = 1.0f;
+    float manaMultiplier = 1.0f;
+    // config generation the values of this entry last changed at, see ABConfigStamp
+    uint32 generation = 0;
+
+    bool SameValues(ABCreatureOverride const& other) const
+    {
+        return forcedPlayerCount == other.forcedPlayerCount && healthMultiplier == other.healthMultiplier
+            && damageMultiplier == other.damageMultiplier && manaMultiplier == other.manaMultiplier;
+    }
+};
+
+// Immutable creature entry -> override table, built once on config load. Entries are kept
+// sorted in a flat array separate from the values, lookups are a branchless binary search.
+class ABCreatureOverrideTable
+{
+public:
+    void Build(std::map<uint32, ABCreatureOverride> const& overrides)
+    {
+        _entries.clear();
+        _overrides.clear();
+        _entries.reserve(overrides.size());
+        _overrides.reserve(overrides.size());
+
+        for (auto const& itr : overrides)
+        {
+            _entries.push_back(itr.first);
+            _overrides.push_back(itr.second);
+        }
+    }
+
+    // returns nullptr if the creature has neither a forced player count nor multipliers
+    ABCreatureOverride const* Find(uint32 entry) const
+    {
+        size_t count = _entries.size();
+        if (!count)
+            return nullptr;
+
+        uint32 const* base = _entries.data();
+        while (count > 1)
+        {
+            size_t half = count / 2;
+            base = base[half] <= entry ? base + half : base;
+            count -= half;
+        }
+
+        return *base == entry ? &_overrides[base - _entries.data()] : nullptr;
+    }
+
+    size_t Size() const { return _entries.size(); }
+
+    // Keeps the generation of the entries that are the same in the previous table and
+    // stamps the others with the new one. Returns the number of entries added, changed or removed.
+    uint32 CarryGenerations(ABCreatureOverrideTable const& previous, uint32 generation)
+    {
+        uint32 changed = 0;
+        size_t i = 0, j = 0;
+
+        while (i < _entries.size() || j < previous._entries.size())
+        {
+            if (j == previous._entries.size() || (i < _entries.size() && _entries[i] < previous._entries[j]))
+            {
+                _overrides[i++].generation = generation;
+                ++changed;
+            }
+            else if (i == _entries.size() || previous._entries[j] < _entries[i])
+            {
+                ++j;
+                ++changed;
+            }
+            else
+            {
+                if (_overrides[i].SameValues(previous._overrides[j]))
+                    _overrides[i].generation = previous._overrides[j].generation;
+                else
+                {
+                    _overrides[i].generation = generation;
+                    ++changed;
+                }
+
+                ++i;
+                ++j;
+            }
+        }
+
+        return changed;
+    }
+
+private:
+    std::vector<uint32> _entries;
+    std::vector<ABCreatureOverride> _overrides;
+};
+
+// AutoBalance.HookStats: how the OnAllCreatureUpdate calls ended, only counted when enabled
+struct ABHookStats
+{
+    std::atomic<uint64> updates{0};
+    std::atomic<uint64> unscaledMap{0};
+    std::atomic<uint64> upToDate{0};
+    // health, mana and armor of the rescales, set or left alone because the value did not move
+    std::atomic<uint64> appliedFields{0};
+    std::atomic<uint64> skippedFields{0};
+    std::atomic<uint64> statUpdates{0};
+    std::atomic<uint64> skippedStatUpdates{0};
+
+    void Reset()
+    {
+        updates.store(0, std::memory_order_relaxed);
+        unscaledMap.store(0, std::memory_order_relaxed);
+        upToDate.store(0, std::memory_order_relaxed);
+        appliedFields.store(0, std::memory_order_relaxed);
+        skippedFields.store(0, std::memory_order_relaxed);
+        statUpdates.store(0, std::memory_order_relaxed);
+        skippedStatUpdates.store(0, std::memory_order_relaxed);
+    }
+};
+
+static ABHookStats HookStats;
+
+int GetValidDebugLevel()
+{
+    int debugLevel = sConfigMgr->GetIntDefault("AutoBalance.DebugLevel", 2);
+
+    if ((debugLevel < 0) || (debugLevel > 3))
+        {
+        return 1;
+        }
+    return debugLevel;
+}
+
+// Splits by the delimiter and trims the tokens, empty tokens are kept
+std::vector<std::string> SplitConfigTokens(std::string const& str, char delimiter)
+{
+    std::vector<std::string> tokens;
+    size_t start = 0;
+
+    while (true)
+    {
+        size_t end = str.find(delimiter, start);
+        std::string token = str.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+        size_t first = token.find_first_not_of(" \t\r\n\"");
+        size_t last = token.find_last_not_of(" \t\r\n\"");
+        tokens.push_back(first == std::string::npos ? "" : token.substr(first, last - first + 1));
+
+        if (end == std::string::npos)
+            break;
+
+        start = end + 1;
+    }
+
+    return tokens;
+}
+
+bool ParseCreatureEntry(std::string const& token, uint32& entry)
+{
+    if (token.empty() || token.find_first_not_of("0123456789") != std::string::npos || token.size() > 9)
+        return false;
+
+    entry = uint32(strtoul(token.c_str(), nullptr, 10));
+    return true;
+}
+
+bool ParseMultiplier(std::string const& token, float& value)
+{
+    if (token.empty())
+        return false;
+
+    char* end = nullptr;
+    value = strtof(token.c_str(), &end);
+    return *end == '\0' && std::isfinite(value) && value >= 0.0f;
+}
+
+// Used for reading the string from the configuration file for those creatures who need to be scaled for XX number of players.
+void LoadForcedCreatureIdsFromString(std::map<uint32, ABCreatureOverride>& overrides, std::string const& creatureIds, int32 forcedPlayerCount, char const* option)
+{
+    for (std::string const& token : SplitConfigTokens(creatureIds, ','))
+    {
+        // trailing and double commas are harmless
+        if (token.empty())
+            continue;
+
+        uint32 entry;
+        if (!ParseCreatureEntry(token, entry))
+        {
+            sLog->outError("AutoBalance: %s contains invalid creature entry '%s', skipped.", option, token.c_str());
+            continue;
+        }
+
+        overrides[entry].forcedPlayerCount = forcedPlayerCount;
+    }
+}
+
+// fields: entry, health multiplier, damage multiplier, mana multiplier
+bool LoadCreatureOverride(std::map<uint32, ABCreatureOverride>& overrides, std::vector<std::string> const& fields)
+{
+    uint32 entry;
+    float health, damage, mana;
+
+    if (fields.size() != 4 || !ParseCreatureEntry(fields[0], entry) || !ParseMultiplier(fields[1], health)
+        || !ParseMultiplier(fields[2], damage) || !ParseMultiplier(fields[3], mana))
+        return false;
+
+    ABCreatureOverride& creatureOverride = overrides[entry];
+    creatureOverride.healthMultiplier = health;
+    creatureOverride.damageMultiplier = damage;
+    creatureOverride.manaMultiplier = mana;
+    return true;
+}
+
+void LoadCreatureOverridesFromString(std::map<uint32, ABCreatureOverride>& overrides, std::string const& list)
+{
+    for (std::string const& token : SplitConfigTokens(list, ','))
+    {
+        if (token.empty())
+            continue;
+
+        if (!LoadCreatureOverride(overrides, SplitConfigTokens(token, ':')))
+            sLog->outError("AutoBalance: AutoBalance.CreatureOverrides contains invalid entry '%s' (expected entry:health:damage:mana), skipped.", token.c_str());
+    }
+}
+
+void LoadCreatureOverridesFromFile(std::map<uint32, ABCreatureOverride>& overrides, std::string const& fileName)
+{
+    std::ifstream file(fileName);
+    if (!file)
+    {
+        sLog->outError("AutoBalance: unable to open creature overrides file '%s'.", fileName.c_str());
+        return;
+    }
+
+    std::string line;
+    uint32 lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+
+        std::vector<std::string> fields = SplitConfigTokens(line, ',');
+        if ((fields.size() == 1 && fields[0].empty()) || fields[0][0] == '#')
+            continue;
+
+        if (!LoadCreatureOverride(overrides, fields))
+            sLog->outError("AutoBalance: %s:%u is invalid (expected entry,health,damage,mana), skipped.", fileName.c_str(), lineNumber);
+    }
+}
+
+enum ABScalingCurveType
+{
+    AB_CURVE_TANH   = 0,
+    AB_CURVE_LINEAR = 1,
+    AB_CURVE_TABLE  = 2
+};
+
+ABInflectionBucket GetInflectionBucket(bool raid, bool heroic, uint32 maxPlayers)
+{
+    if (!raid)
+        return heroic ? AB_INFLECTION_DUNGEON_HEROIC : AB_INFLECTION_DUNGEON;
+
+    switch (maxPlayers)
+    {
+        case 10:
+            return heroic ? AB_INFLECTION_RAID10_HEROIC : AB_INFLECTION_RAID10;
+        case 25:
+            return heroic ? AB_INFLECTION_RAID25_HEROIC : AB_INFLECTION_RAID25;
+        default:
+            return heroic ? AB_INFLECTION_RAID_HEROIC : AB_INFLECTION_RAID;
+    }
+}
+
+// Note: InflectionPoint handle the number of players required to get 50% health.
+//       you'd adjust this to raise or lower the hp modifier for per additional player in a non-whole group.
+//
+//       diff modify the rate of percentage increase between
+//       number of players. Generally the closer to the value of 1 you have this
+//       the less gradual the rate will be. For example in a 5 man it would take 3
+//       total players to face a mob at full health.
+//
+//       The +1 and /2 values raise the TanH function to a positive range and make
+//       sure the modifier never goes above the value or 1.0 or below 0.
+//
+float GetTanhMultiplier(ABInflectionConfig const& inflection, ABInflectionBucket bucket, bool boss, uint32 maxNumberOfPlayers, uint32 playerCount)
+{
+    float inflectionValue  = (float)maxNumberOfPlayers;
+    inflectionValue *= inflection.points[bucket];
+
+    if (boss)
+        inflectionValue *= inflection.bossMultiplier;
+
+    float diff = ((float)maxNumberOfPlayers/5)*1.5f;
+    return (tanh(((float)playerCount - inflectionValue) / diff) + 1.0f) / 2.0f;
+}
+
+// The default multiplier for (inflection bucket, boss, max players, player count), compiled into
+// a dense table on config load so that a rescale only needs one indexed load. The curve is either
+// the tanh above, a piecewise-linear curve over playerCount / maxPlayers or explicit values per size.
+class ABScalingCurve
+{
+public:
+    // largest group size covered by the table, anything bigger is computed on demand
+    static uint32 const MaxTablePlayers = 40;
+    void Build(ABScalingCurveType type, std::string const& points, ABInflectionConfig const& inflection)
+    {
+        _type = type;
+        _inflection = inflection;
+        _points.clear();
+        _tables.assign(MaxTablePlayers + 1, std::vector<float>());
+
+        if (_type == AB_CURVE_LINEAR && !LoadPoints(points))
+            _type = AB_CURVE_TANH;
+        else if (_type == AB_CURVE_TABLE)
+            LoadTables();
+
+        // one triangle of maxPlayers rows with playerCount 0..maxPlayers-1 per (bucket, boss)
+        _values.resize(MAX_AB_INFLECTION_BUCKETS * 2 * TriangleSize);
+
+        for (uint32 bucket = 0; bucket < MAX_AB_INFLECTION_BUCKETS; ++bucket)
+            for (uint32 boss = 0; boss < 2; ++boss)
+                for (uint32 maxPlayers = 1; maxPlayers <= MaxTablePlayers; ++maxPlayers)
+                    for (uint32 count = 0; count < maxPlayers; ++count)
+                        _values[Index(ABInflectionBucket(bucket), boss, maxPlayers, count)] = Compute(ABInflectionBucket(bucket), boss, maxPlayers, count);
+
+        if (_type == AB_CURVE_TANH)
+            VerifyTanh();
+    }
+
+    // only valid for playerCount < maxNumberOfPlayers, full groups are never scaled
+    float Get(ABInflectionBucket bucket, bool boss, uint32 maxNumberOfPlayers, uint32 playerCount) const
+    {
+        if (maxNumberOfPlayers > MaxTablePlayers)
+            return Compute(bucket, boss, maxNumberOfPlayers, playerCount);
+
+        return _values[Index(bucket, boss, maxNumberOfPlayers, playerCount)];
+    }
+
+    // whether both curves give the same multipliers for all maps of the bucket
+    bool SameBucket(ABScalingCurve const& other, ABInflectionBucket bucket) const
+    {
+        // the sizes above the table are computed from these on demand
+        if (_type != other._type || _points != other._points || _tables != other._tables
+            || _inflection.points[bucket] != other._inflection.points[bucket] || _inflection.bossMultiplier != other._inflection.bossMultiplier)
+            return false;
+
+        if (_values.size() != other._values.size())
+            return false;
+
+        uint32 begin = Index(bucket, false, 1, 0);
+        uint32 end = begin + 2 * TriangleSize;
+        return std::equal(_values.begin() + begin, _values.begin() + end, other._values.begin() + begin);
+    }
+
+private:
+    static uint32 const TriangleSize = MaxTablePlayers * (MaxTablePlayers + 1) / 2;
+
+    static uint32 Index(ABInflectionBucket bucket, bool boss, uint32 maxPlayers, uint32 playerCount)
+    {
+        return (bucket * 2 + boss) * TriangleSize + maxPlayers * (maxPlayers - 1) / 2 + playerCount;
+    }
+
+    float Compute(ABInflectionBucket bucket, bool boss, uint32 maxNumberOfPlayers, uint32 playerCount) const
+    {
+        switch (_type)
+        {
+            case AB_CURVE_LINEAR:
+            {
+                float x = float(playerCount) / float(maxNumberOfPlayers);
+                if (x <= _points.front().first)
+                    return _points.front().second;
+
+                for (size_t i = 1; i < _points.size(); ++i)
+                    if (x <= _points[i].first)
+                    {
+                        std::pair<float, float> const& from = _points[i - 1];
+                        std::pair<float, float> const& to = _points[i];
+                        return from.second + (to.second - from.second) * (x - from.first) / (to.first - from.first);
+                    }
+
+                return _points.back().second;
+            }
+            case AB_CURVE_TABLE:
+                if (maxNumberOfPlayers <= MaxTablePlayers && !_tables[maxNumberOfPlayers].empty())
+                    return _tables[maxNumberOfPlayers][playerCount];
+                // no table for this size
+                return GetTanhMultiplier(_inflection, bucket, boss, maxNumberOfPlayers, playerCount);
+            default:
+                return GetTanhMultiplier(_inflection, bucket, boss, maxNumberOfPlayers, playerCount);
+        }
+    }
+
+    // "x:y,x:y,..." with x = playerCount / maxPlayers ascending in [0, 1]
+    bool LoadPoints(std::string const& points)
+    {
+        for (std::string const& token : SplitConfigTokens(points, ','))
+        {
+            if (token.empty())
+                continue;
+
+            std::vector<std::string> fields = SplitConfigTokens(token, ':');
+            float x, y;
+            if (fields.size() != 2 || !ParseMultiplier(fields[0], x) || !ParseMultiplier(fields[1], y) || x > 1.0f
+                || (!_points.empty() && x <= _points.back().first))
+            {
+                sLog->outError("AutoBalance: AutoBalance.ScalingCurve.Points contains invalid point '%s', falling back to the tanh curve.", token.c_str());
+                _points.clear();
+                return false;
+            }
+
+            _points.emplace_back(x, y);
+        }
+
+        if (_points.empty())
+        {
+            sLog->outError("AutoBalance: AutoBalance.ScalingCurve.Points is empty, falling back to the tanh curve.");
+            return false;
+        }
+
+        return true;
+    }
+
+    // AutoBalance.ScalingCurve.TableXX = "v1,v2,..." with one value per player count 1..XX-1
+    void LoadTables()
+    {
+        for (uint32 maxPlayers = 2; maxPlayers <= MaxTablePlayers; ++maxPlayers)
+        {
+            std::string option = "AutoBalance.ScalingCurve.Table" + std::to_string(maxPlayers);
+            std::string list = sConfigMgr->GetStringDefault(option, "");
+            if (list.empty())
+                continue;
+
+            // player count 0 never gets scaled, it just mirrors the value for 1 player
+            std::vector<float>& table = _tables[maxPlayers];
+            table.push_back(0.0f);
+            for (std::string const& token : SplitConfigTokens(list, ','))
+            {
+                float value;
+                if (!ParseMultiplier(token, value))
+                {
+                    sLog->outError("AutoBalance: %s contains invalid value '%s', using the tanh curve for %u players.", option.c_str(), token.c_str(), maxPlayers);
+                    table.clear();
+                    break;
+                }
+
+                table.push_back(value);
+            }
+
+            if (table.empty())
+                continue;
+
+            if (table.size() != maxPlayers)
+            {
+                sLog->outError("AutoBalance: %s needs %u values (player count 1 to %u), using the tanh curve for %u players.", option.c_str(), maxPlayers - 1, maxPlayers - 1, maxPlayers);
+                table.clear();
+                continue;
+            }
+
+            table[0] = table[1];
+        }
+    }
+
+    // compares every compiled cell with the formula evaluated in double precision
+    void VerifyTanh() const
+    {
+        double maxError = 0.0;
+
+        for (uint32 bucket = 0; bucket < MAX_AB_INFLECTION_BUCKETS; ++bucket)
+            for (uint32 boss = 0; boss < 2; ++boss)
+                for (uint32 maxPlayers = 1; maxPlayers <= MaxTablePlayers; ++maxPlayers)
+                    for (uint32 count = 0; count < maxPlayers; ++count)
+                    {
+                        double inflectionValue = double(maxPlayers) * _inflection.points[bucket] * (boss ? _inflection.bossMultiplier : 1.0f);
+                        double expected = (std::tanh((double(count) - inflectionValue) / (double(maxPlayers) / 5 * 1.5)) + 1.0) / 2.0;
+                        maxError = std::max(maxError, std::fabs(expected - Get(ABInflectionBucket(bucket), boss, maxPlayers, count)));
+                    }
+
+        // float evaluation of the formula stays well within this
+        double const tolerance = 1e-5;
+        if (maxError > tolerance)
+            sLog->outError("AutoBalance: compiled scaling curve deviates from the tanh formula by %f (tolerance %f).", maxError, tolerance);
+    }
+
+    ABScalingCurveType _type = AB_CURVE_TANH;
+    ABInflectionConfig _inflection = {};
+    std::vector<std::pair<float, float>> _points;
+    std::vector<std::vector<float>> _tables;
+    std::vector<float> _values;
+};
+
+// The settings the stat scaling depends on, taken from the config on load
+struct ABScalingConfig
+{
+    float globalRate;
+    float healthMultiplier;
+    float manaMultiplier;
+    float armorMultiplier;
+    float damageMultiplier;
+    float minHealthModifier;
+    float minManaModifier;
+    float minDamageModifier;
+    bool levelScaling;
+    bool levelEndGameBoost;
+};
+
+struct ABScalingInput;
+struct ABScaledStats;
+
+// ComputeScaledStats or one of its specializations, see SelectStatsKernel
+typedef ABScaledStats (*ABStatsKernel)(ABScalingInput const& in, ABScalingConfig const& config);
+ABScaledStats ComputeScaledStats(ABScalingInput const& in, ABScalingConfig const& config);
+
+// All AutoBalance settings. A snapshot is never changed once published, a config load or
+// setoffset publishes a new one. Map update threads read the current one with a single
+// atomic load and keep using it for the whole hook, so they never see half of a reload.
+struct ABConfig
+{
+    // bumped by every publish, starts at 1 so that it never matches a fresh creature
+    uint32 generation = 1;
+    // generation the settings of all maps, of each inflection bucket and of the immunities
+    // last changed at, carried over by publishes that leave them alone
+    uint32 scalingGeneration = 0;
+    uint32 bucketGeneration[MAX_AB_INFLECTION_BUCKETS] = {};
+    uint32 immunityGeneration = 0;
+    // what changed compared to the previous snapshot, for the log and .autobalance reloadstats
+    std::string changes;
+
+    ABConfigStamp GetStamp(ABInflectionBucket bucket, ABCreatureOverride const* creatureOverride) const
+    {
+        ABConfigStamp stamp;
+        stamp.scaling = scalingGeneration;
+        stamp.bucket = bucketGeneration[bucket];
+        stamp.entry = creatureOverride ? creatureOverride->generation : 0;
+        return stamp;
+    }
+
+    bool enabled = false;
+    bool DungeonsOnly = true;
+    bool HookStatsEnabled = false;
+    // AutoBalance.DebugLevel, see AB_LOG
+    int8 DebugLevel = 0;
+    bool PerfEnabled = false;
+    std::string PerfDumpFile;
+    uint32 PerfDumpInterval = 0;
+    uint32 TraceBufferSize = 0;
+    std::string TraceDirectory;
+    bool PlayerChangeNotify = false;
+    bool LevelUseDb = false;
+    bool PrecomputeEnabled = false;
+    bool rewardEnabled = false;
+    bool DungeonScaleDownXP = false;
+    // cheaphack for difficulty server-wide.
+    // Another value TODO in player class for the party leader's value to determine dungeon difficulty.
+    int8 PlayerCountDifficultyOffset = 0;
+    int8 LevelScaling = 0;
+    int8 higherOffset = 0;
+    int8 lowerOffset = 0;
+    uint32 rewardRaid = 0;
+    uint32 rewardDungeon = 0;
+    uint32 MinPlayerReward = 0;
+    uint32 NotifyMergeWindow = 0;
+    uint32 NotifyMinInterval = 0;
+    uint32 RescaleBudgetCreatures = 0;
+    uint32 RescaleBudgetMicroseconds = 0;
+    float RescaleNearDistance = 0.0f;
+    uint32 AsyncRescaleThreads = 0;
+
+    bool ImmunitiesEnabled = false;
+    bool ImmunitiesPetEnabled = false;
+    uint32 ImmunitiesMaxPlayers = 0;
+    bool ImmunitiesCharmEnabled = false;
+    bool ImmunitiesFearEnabled = false;
+    bool ImmunitiesSilenceEnabled = false;
+    bool ImmunitiesSleepEnabled = false;
+    bool ImmunitiesStunEnabled = false;
+    bool ImmunitiesFreezeEnabled = false;
+    bool ImmunitiesKnockoutEnabled = false;
+    bool ImmunitiesPolymorphEnabled = false;
+    bool ImmunitiesHorrorEnabled = false;
+    bool ImmunitiesDazeEnabled = false;
+    bool ImmunitiesSappedEnabled = false;
+    bool ImmunitiesKnockBackEnabled = false;
+    bool ImmunitiesPowerDrainEnabled = false;
+
+    ABInflectionConfig inflection = {};
+    ABScalingCurve curve;
+    ABScalingConfig scaling = {};
+    // the kernels specialized for the scaling settings, see GetStatsKernelIndex. The snapshot
+    // used before the config is loaded has the generic one
+    ABStatsKernel statsKernels[4] = { &ComputeScaledStats, &ComputeScaledStats, &ComputeScaledStats, &ComputeScaledStats };
+    // Built from the AutoBalance.ForcedIDXX / DisabledID lists and the creature overrides.
+    ABCreatureOverrideTable creatureOverrides;
+};
+
+// the snapshot used before the config has been loaded, everything disabled
+static ABConfig const DefaultConfig;
+static std::atomic<ABConfig const*> CurrentConfig(&DefaultConfig);
+
+// Replaced snapshots may still be in use by a hook on another thread. Hooks never keep a
+// snapshot beyond their own call, so their reference is dropped once they have been retired
+// for a while. The worker threads can hold one for longer, they take a counted reference
+// through GetConfigSnapshot, which keeps it alive until their job is done.
+static std::mutex ConfigPublishLock;
+static std::shared_ptr<ABConfig const> PublishedConfig;
+static std::vector<std::pair<uint32, std::shared_ptr<ABConfig const>>> RetiredConfigs;
+static uint32 const ConfigRetireTime = 60 * IN_MILLISECONDS;
+
+// dungeon maps with immunity state, and how many of them still have to apply changed immunity settings
+static std::atomic<uint32> DungeonMapInfos(0);
+static std::atomic<uint32> PendingImmunityReloads(0);
+
+// the work done because of the last publish, see .autobalance reloadstats
+struct ABReloadStats
+{
+    std::atomic<uint32> rescaledCreatures{0};
+    std::atomic<uint32> immunityMaps{0};
+};
+
+static ABReloadStats ReloadStats;
+
+static char const* const InflectionBucketNames[MAX_AB_INFLECTION_BUCKETS] =
+{
+    "InflectionPoint", "InflectionPointHeroic", "InflectionPointRaid10M", "InflectionPointRaid10MHeroic",
+    "InflectionPointRaid25M", "InflectionPointRaid25MHeroic", "InflectionPointRaid", "InflectionPointRaidHeroic"
+};
+
+bool SameScalingConfig(ABScalingConfig const& a, ABScalingConfig const& b)
+{
+    return a.globalRate == b.globalRate && a.healthMultiplier == b.healthMultiplier && a.manaMultiplier == b.manaMultiplier
+        && a.armorMultiplier == b.armorMultiplier && a.damageMultiplier == b.damageMultiplier && a.minHealthModifier == b.minHealthModifier
+        && a.minManaModifier == b.minManaModifier && a.minDamageModifier == b.minDamageModifier && a.levelScaling == b.levelScaling
+        && a.levelEndGameBoost == b.levelEndGameBoost;
+}
+
+bool SameImmunities(ABConfig const& a, ABConfig const& b)
+{
+    return a.ImmunitiesEnabled == b.ImmunitiesEnabled && a.ImmunitiesPetEnabled == b.ImmunitiesPetEnabled
+        && a.ImmunitiesMaxPlayers == b.ImmunitiesMaxPlayers && a.ImmunitiesCharmEnabled == b.ImmunitiesCharmEnabled
+        && a.ImmunitiesFearEnabled == b.ImmunitiesFearEnabled && a.ImmunitiesSilenceEnabled == b.ImmunitiesSilenceEnabled
+        && a.ImmunitiesSleepEnabled == b.ImmunitiesSleepEnabled && a.ImmunitiesStunEnabled == b.ImmunitiesStunEnabled
+        && a.ImmunitiesFreezeEnabled == b.ImmunitiesFreezeEnabled && a.ImmunitiesKnockoutEnabled == b.ImmunitiesKnockoutEnabled
+        && a.ImmunitiesPolymorphEnabled == b.ImmunitiesPolymorphEnabled && a.ImmunitiesHorrorEnabled == b.ImmunitiesHorrorEnabled
+        && a.ImmunitiesDazeEnabled == b.ImmunitiesDazeEnabled && a.ImmunitiesSappedEnabled == b.ImmunitiesSappedEnabled
+        && a.ImmunitiesKnockBackEnabled == b.ImmunitiesKnockBackEnabled && a.ImmunitiesPowerDrainEnabled == b.ImmunitiesPowerDrainEnabled;
+}
+
+// Compares a new snapshot with the one it replaces and stamps the new generation only on
+// what actually changed, so creatures and maps not affected keep their state.
+void DiffConfig(ABConfig const& previous, ABConfig& config)
+{
+    std::vector<std::string> changes;
+
+    // everything counts as changed on the first load
+    bool initial = &previous == &DefaultConfig;
+
+    bool scalingChanged = initial || config.enabled != previous.enabled || config.DungeonsOnly != previous.DungeonsOnly
+        || config.PlayerCountDifficultyOffset != previous.PlayerCountDifficultyOffset || config.LevelScaling != previous.LevelScaling
+        || config.higherOffset != previous.higherOffset || config.lowerOffset != previous.lowerOffset
+        || config.LevelUseDb != previous.LevelUseDb || !SameScalingConfig(config.scaling, previous.scaling);
+    config.scalingGeneration = scalingChanged ? config.generation : previous.scalingGeneration;
+    if (scalingChanged)
+        changes.push_back("the scaling of all maps");
+
+    std::string buckets;
+    for (uint32 bucket = 0; bucket < MAX_AB_INFLECTION_BUCKETS; ++bucket)
+    {
+        bool bucketChanged = initial || !config.curve.SameBucket(previous.curve, ABInflectionBucket(bucket));
+        config.bucketGeneration[bucket] = bucketChanged ? config.generation : previous.bucketGeneration[bucket];
+        // already covered by the scaling of all maps
+        if (bucketChanged && !scalingChanged)
+            buckets += std::string(buckets.empty() ? "" : " ") + InflectionBucketNames[bucket];
+    }
+
+    if (!buckets.empty())
+        changes.push_back("the scaling curve of " + buckets);
+
+    if (uint32 entries = config.creatureOverrides.CarryGenerations(previous.creatureOverrides, config.generation))
+        if (!scalingChanged)
+            changes.push_back(std::to_string(entries) + " creature entries");
+
+    bool immunitiesChanged = initial || !SameImmunities(config, previous);
+    config.immunityGeneration = immunitiesChanged ? config.generation : previous.immunityGeneration;
+    if (immunitiesChanged)
+        changes.push_back("the immunities of " + std::to_string(DungeonMapInfos.load(std::memory_order_relaxed)) + " dungeon maps");
+
+    // a copy of the previous snapshot starts out with its description
+    config.changes.clear();
+    for (std::string const& change : changes)
+        config.changes += (config.changes.empty() ? "" : ", ") + change;
+
+    if (config.changes.empty())
+        config.changes = "nothing the scaling or the immunities depend on";
+}
+
+ABConfig const& GetConfig()
+{
+    return *CurrentConfig.load(std::memory_order_acquire);
+}
+
+// for threads that keep using a snapshot longer than a hook call, takes the publish lock
+std::shared_ptr<ABConfig const> GetConfigSnapshot()
+{
+    std::lock_guard<std::mutex> guard(ConfigPublishLock);
+    if (PublishedConfig)
+        return PublishedConfig;
+
+    // the default snapshot is static, nothing to keep alive
+    return std::shared_ptr<ABConfig const>(std::shared_ptr<ABConfig const>(), &DefaultConfig);
+}
+
+bool IsPerfEnabled()
+{
+    return GetConfig().PerfEnabled;
+}
+
+// the global counters in the Prometheus text format, histograms in seconds
+std::string FormatPerfPrometheus(ABPerfValues const& values)
+{
+    std::string text;
+    char line[256];
+
+    for (uint32 i = 0; i < MAX_AB_PERF_COUNTERS; ++i)
+    {
+        snprintf(line, sizeof(line), "# HELP autobalance_%s_total %s\n# TYPE autobalance_%s_total counter\nautobalance_%s_total %llu\n",
+            PerfCounterNames[i][0], PerfCounterNames[i][1], PerfCounterNames[i][0], PerfCounterNames[i][0], (unsigned long long)values.counters[i]);
+        text += line;
+    }
+
+    for (uint32 timer = 0; timer < MAX_AB_PERF_TIMERS; ++timer)
+    {
+        char const* name = PerfTimerNames[timer][0];
+        snprintf(line, sizeof(line), "# HELP autobalance_%s_seconds %s\n# TYPE autobalance_%s_seconds histogram\n", name, PerfTimerNames[timer][1], name);
+        text += line;
+
+        uint64 cumulative = 0;
+        for (uint32 bucket = 0; bucket < AB_PERF_BUCKETS - 1; ++bucket)
+        {
+            cumulative += values.buckets[timer][bucket];
+            snprintf(line, sizeof(line), "autobalance_%s_seconds_bucket{le=\"%.9g\"} %llu\n", name, double(uint64(1) << bucket) / 1e9, (unsigned long long)cumulative);
+            text += line;
+        }
+
+        snprintf(line, sizeof(line), "autobalance_%s_seconds_bucket{le=\"+Inf\"} %llu\nautobalance_%s_seconds_sum %.9f\nautobalance_%s_seconds_count %llu\n",
+            name, (unsigned long long)values.timeCount[timer], name, values.timeSum[timer] / 1e9, name, (unsigned long long)values.timeCount[timer]);
+        text += line;
+    }
+
+    return text;
+}
+
+// written next to the target and renamed, so a scraper never reads half of it
+void WritePerfDump(std::string const& fileName)
+{
+    std::string tempName = fileName + ".tmp";
+    {
+        std::ofstream file(tempName, std::ios::trunc);
+        if (!file)
+        {
+            sLog->outError("AutoBalance.Perf.DumpFile: could not write %s.", tempName.c_str());
+            return;
+        }
+
+        file << FormatPerfPrometheus(Perf.Collect());
+    }
+
+    if (std::rename(tempName.c_str(), fileName.c_str()) != 0)
+        sLog->outError("AutoBalance.Perf.DumpFile: could not replace %s.", fileName.c_str());
+}
+
+void PublishConfig(std::unique_ptr<ABConfig> config)
+{
+    std::lock_guard<std::mutex> guard(ConfigPublishLock);
+
+    uint32 now = getMSTime();
+    RetiredConfigs.erase(std::remove_if(RetiredConfigs.begin(), RetiredConfigs.end(), [now](std::pair<uint32, std::shared_ptr<ABConfig const>> const& retired)
+    {
+        return getMSTimeDiff(retired.first, now) >= ConfigRetireTime;
+    }), RetiredConfigs.end());
+
+    ABConfig const* previous = CurrentConfig.load(std::memory_order_relaxed);
+    config->generation = previous->generation + 1;
+    DiffConfig(*previous, *config);
+
+    ReloadStats.rescaledCreatures.store(0, std::memory_order_relaxed);
+    ReloadStats.immunityMaps.store(0, std::memory_order_relaxed);
+    if (config->immunityGeneration != previous->immunityGeneration)
+        PendingImmunityReloads.store(DungeonMapInfos.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    std::shared_ptr<ABConfig const> published(config.release());
+    CurrentConfig.store(published.get(), std::memory_order_release);
+
+    if (PublishedConfig)
+        RetiredConfigs.emplace_back(now, std::move(PublishedConfig));
+    PublishedConfig = published;
+
+    sLog->outString("AutoBalance: config generation %u changes %s.", published->generation, published->changes.c_str());
+}
+
+// Creatures store the value they have been scaled at, so an already scaled creature
+// only needs a single compare on update. Both counters only grow, so the sum changes
+// whenever either of them does.
+uint32 GetScalingGeneration(AutoBalanceMapInfo const* mapABInfo)
+{
+    ABConfig const& config = GetConfig();
+    return mapABInfo->generation + config.generation;
+}
+
+enum ABMapScaling : uint8
+{
+    AB_MAP_UNKNOWN  = 0,
+    AB_MAP_UNSCALED = 1,
+    AB_MAP_SCALED   = 2
+};
+
+// Whether creatures of a map id are scaled at all, classified the first time the map id is seen
+// and reset on config reload. Read by every creature update, so it is a plain table of relaxed
+// atomics rather than something hanging off the map's CustomData.
+static std::array<std::atomic<uint8>, 1024> MapScaling;
+
+bool IsScaledMap(Map const* map)
+{
+    ABConfig const& config = GetConfig();
+    uint32 mapId = map->GetId();
+
+    if (mapId < MapScaling.size())
+        if (uint8 scaling = MapScaling[mapId].load(std::memory_order_relaxed))
+            return scaling == AB_MAP_SCALED;
+
+    // the map type only depends on the map id, so all instances share the answer
+    bool scaled = !config.DungeonsOnly || map->IsDungeon() || map->IsBattleground();
+
+    if (mapId < MapScaling.size())
+        MapScaling[mapId].store(scaled ? AB_MAP_SCALED : AB_MAP_UNSCALED, std::memory_order_relaxed);
+
+    return scaled;
+}
+
+void ResetMapScaling()
+{
+    for (std::atomic<uint8>& scaling : MapScaling)
+        scaling.store(AB_MAP_UNKNOWN, std::memory_order_relaxed);
+}
+
+
+// Everything the stats of one creature are scaled from. The base stats are the
+// CreatureBaseStats values of the template's original level and of the selected level.
+struct ABScalingInput
+{
+    // template maxlevel
+    uint8 originalLevel;
+    uint8 selectedLevel;
+    uint8 mapLevel;
+    float modHealth;
+    // critters and special creatures keep their level and stats
+    bool skipLevel;
+    // LevelUseDb and the selected level is within the template's range
+    bool useDefStats;
+    bool isRaid;
+    uint8 areaMinLevel;
+    uint8 areaMaxLevel;
+
+    uint32 baseHealth;
+    uint32 baseMana;
+    uint32 baseArmor;
+    float baseDamage;
+
+    uint32 levelBaseHealth[3];
+    uint32 levelMana;
+    uint32 levelArmor;
+    float levelBaseDamage[3];
+
+    // scaling curve result, possibly changed by OnAfterDefaultMultiplier
+    float defaultMultiplier;
+    // creature overrides, 1 if there is none
+    float overrideHealth;
+    float overrideMana;
+    float overrideDamage;
+};
+
+struct ABScaledStats
+{
+    float healthMultiplier;
+    float manaMultiplier;
+    float armorMultiplier;
+    float damageMultiplier;
+    uint32 health;
+    uint32 mana;
+    uint32 armor;
+};
+
+// The stat scaling of one creature. No side effects, ModifyCreatureAttributes only
+// applies the result, so this can be checked against the golden values (selftest).
+// The settings and creature flags that decide the branches are template arguments, so each
+// combination compiles to straight line code, see SelectStatsKernel.
+template<bool LevelStats, bool EndGameBoost, bool IsRaid>
+ABScaledStats ComputeScaledStatsKernel(ABScalingInput const& in, ABScalingConfig const& config)
+{
+    ABScaledStats out;
+    // special increasing for end-game contents
+    bool endGameBoost = EndGameBoost && in.selectedLevel >= 75 && in.originalLevel < 75;
+
+    out.healthMultiplier = config.healthMultiplier * in.defaultMultiplier * config.globalRate;
+    out.healthMultiplier *= in.overrideHealth;
+
+    if (out.healthMultiplier <= config.minHealthModifier)
+        out.healthMultiplier = config.minHealthModifier;
+
+    float hpStatsRate = 1.0f;
+    if (LevelStats)
+    {
+        float newBaseHealth = 0;
+        if (in.mapLevel <= 60)
+            newBaseHealth = in.levelBaseHealth[0];
+        else if (in.mapLevel <= 70)
+            newBaseHealth = in.levelBaseHealth[1];
+        else
+        {
+            newBaseHealth = in.levelBaseHealth[2];
+            if (endGameBoost)
+                newBaseHealth *= float(in.selectedLevel - 70) * 0.3f;
+        }
+
+        float newHealth = newBaseHealth * in.modHealth;
+
+        // allows health to be different with creatures that originally
+        // differentiate their health by different level instead of multiplier field.
+        // expecially in dungeons. The health reduction decrease if original level is similar to the area max level
+        if (in.originalLevel >= in.areaMinLevel && in.originalLevel < in.areaMaxLevel)
+        {
+            float reduction = newHealth / float(in.areaMaxLevel - in.areaMinLevel) * (float(in.areaMaxLevel - in.originalLevel) * 0.3f); // never more than 30%
+            if (reduction > 0 && reduction < newHealth)
+                newHealth -= reduction;
+        }
+
+        hpStatsRate = newHealth / float(in.baseHealth);
+    }
+
+    out.healthMultiplier *= hpStatsRate;
+    out.health = round(((float) in.baseHealth * out.healthMultiplier) + 1.0f);
+
+    float manaStatsRate = 1.0f;
+    if (LevelStats)
+    {
+        float newMana = in.levelMana;
+        manaStatsRate = newMana / float(in.baseMana);
+    }
+
+    out.manaMultiplier = manaStatsRate * config.manaMultiplier * in.defaultMultiplier * config.globalRate;
+    out.manaMultiplier *= in.overrideMana;
+
+    if (out.manaMultiplier <= config.minManaModifier)
+        out.manaMultiplier = config.minManaModifier;
+
+    out.mana = round(in.baseMana * out.manaMultiplier);
+
+    out.damageMultiplier = in.defaultMultiplier * config.globalRate * config.damageMultiplier;
+    out.damageMultiplier *= in.overrideDamage;
+
+    // Can not be less then Min_D_Mod
+    if (out.damageMultiplier <= config.minDamageModifier)
+        out.damageMultiplier = config.minDamageModifier;
+
+    if (LevelStats)
+    {
+        float newDmgBase = 0;
+        if (in.mapLevel <= 60)
+            newDmgBase = in.levelBaseDamage[0];
+        else if (in.mapLevel <= 70)
+            newDmgBase = in.levelBaseDamage[1];
+        else
+        {
+            newDmgBase = in.levelBaseDamage[2];
+            if (endGameBoost && !IsRaid)
+                newDmgBase *= float(in.selectedLevel - 70) * 0.3f;
+        }
+
+        out.damageMultiplier *= newDmgBase / in.baseDamage;
+    }
+
+    out.armorMultiplier = config.globalRate * config.armorMultiplier;
+    out.armor = round(out.armorMultiplier * (LevelStats ? in.levelArmor : in.baseArmor));
+
+    return out;
+}
+
+// The kernel for the scaling settings and the creature. The raid flag only matters to the
+// end game boost, the others share the instantiations without it.
+ABStatsKernel SelectStatsKernel(ABScalingConfig const& config, bool levelStats, bool isRaid)
+{
+    if (!config.levelScaling || !levelStats)
+        return &ComputeScaledStatsKernel<false, false, false>;
+
+    if (!config.levelEndGameBoost)
+        return &ComputeScaledStatsKernel<true, false, false>;
+
+    return isRaid ? &ComputeScaledStatsKernel<true, true, true> : &ComputeScaledStatsKernel<true, true, false>;
+}
+
+// index into ABConfig::statsKernels: the creature may use the level stats, and is in a raid
+uint32 GetStatsKernelIndex(ABScalingInput const& in)
+{
+    return uint32(!in.useDefStats && !in.skipLevel) | uint32(in.isRaid) << 1;
+}
+
+void SelectStatsKernels(ABScalingConfig const& config, ABStatsKernel (&kernels)[4])
+{
+    for (uint32 index = 0; index < 4; ++index)
+        kernels[index] = SelectStatsKernel(config, (index & 1) != 0, (index & 2) != 0);
+}
+
+// the generic path, picks the kernel on every call
+ABScaledStats ComputeScaledStats(ABScalingInput const& in, ABScalingConfig const& config)
+{
+    return SelectStatsKernel(config, !in.useDefStats && !in.skipLevel, in.isRaid)(in, config);
+}
+
+// Golden values of ComputeScaledStats, generated with the scaling code as it was before
+// it became a separate kernel. Changes that are not meant to alter the scaling have to
+// keep them passing, see the selftest command.
+struct ABGoldenCase
+{
+    uint8 config;
+    ABScalingInput input;
+    ABScaledStats expected;
+};
+
+static ABScalingConfig const GoldenConfigs[] =
+{
+    // defaults
+    { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 0.01f, 0.01f, 0.01f, true, true },
+    // custom rates, high minimum modifiers, no end game boost
+    { 1.5f, 2.0f, 0.5f, 1.25f, 0.8f, 0.5f, 0.1f, 0.3f, true, false },
+    // no level scaling
+    { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 0.01f, 0.01f, 0.01f, false, true },
+};
+
+static ABGoldenCase const GoldenCases[] =
+{
+    { 0, { 80, 80, 80, 1.0f, false, false, false, 0, 0, 9610, 3496, 9729, 107.900002f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 1.0f, 1.0f, 1.0f, 1.0f }, { 1.0f, 1.0f, 1.0f, 1.0f, 9611, 3496, 9729 } },
+    { 0, { 80, 80, 80, 1.5f, false, false, false, 78, 80, 14415, 3496, 9729, 107.900002f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 0.5f, 1.0f, 1.0f, 1.0f }, { 0.5f, 0.5f, 1.0f, 0.5f, 7209, 1748, 9729 } },
+    { 0, { 70, 83, 80, 1.20000005f, false, false, false, 69, 72, 6411, 3202, 5234, 64.9000015f, { 4500, 6400, 12600 }, 3600, 10600, { 55.0f, 78.0f, 112.0f }, 0.330000013f, 1.0f, 1.0f, 1.0f }, { 2.42825675f, 0.371018112f, 1.0f, 2.22101712f, 15569, 1188, 10600 } },
+    { 0, { 73, 83, 80, 2.0f, false, false, true, 0, 0, 14364, 3323, 6000, 93.0f, { 4500, 6400, 12600 }, 3600, 10600, { 55.0f, 78.0f, 112.0f }, 0.75f, 1.0f, 1.0f, 1.0f }, { 5.13157892f, 0.812518835f, 1.0f, 0.903225839f, 73711, 2700, 10600 } },
+    { 0, { 58, 80, 80, 1.0f, false, false, false, 55, 60, 2862, 2676, 3257, 31.1000004f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 0.200000003f, 1.0f, 1.0f, 1.0f }, { 1.77291417f, 0.261285514f, 1.0f, 2.08167219f, 5075, 699, 9729 } },
+    { 0, { 62, 70, 70, 1.0f, false, false, false, 60, 64, 3888, 2812, 3618, 51.4000015f, { 3734, 5342, 5342 }, 3202, 5234, { 45.2000008f, 64.9000015f, 64.9000015f }, 0.600000024f, 1.0f, 1.0f, 1.0f }, { 0.700725317f, 0.683214784f, 1.0f, 0.757587612f, 2725, 1921, 5234 } },
+    { 0, { 30, 58, 58, 3.0f, false, false, false, 28, 32, 3198, 1093, 1265, 14.8999996f, { 2862, 2862, 2862 }, 2676, 3257, { 31.1000004f, 31.1000004f, 31.1000004f }, 0.400000006f, 1.0f, 1.0f, 1.0f }, { 0.912833035f, 0.97932303f, 1.0f, 0.834899366f, 2920, 1070, 3257 } },
+    { 0, { 15, 30, 30, 1.0f, false, false, false, 0, 0, 328, 350, 620, 6.5f, { 1066, 1066, 1066 }, 1093, 1265, { 14.8999996f, 14.8999996f, 14.8999996f }, 0.899999976f, 1.0f, 1.0f, 1.0f }, { 2.92499995f, 2.81057119f, 1.0f, 2.06307673f, 960, 984, 1265 } },
+    { 0, { 80, 80, 80, 1.0f, true, false, false, 0, 0, 9610, 3496, 9729, 107.900002f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 0.25f, 1.0f, 1.0f, 1.0f }, { 0.25f, 0.25f, 1.0f, 0.25f, 2404, 874, 9729 } },
+    { 0, { 70, 70, 80, 1.0f, false, true, false, 0, 0, 5342, 3202, 5234, 64.9000015f, { 3734, 5342, 5342 }, 3202, 5234, { 45.2000008f, 64.9000015f, 64.9000015f }, 0.25f, 1.0f, 1.0f, 1.0f }, { 0.25f, 0.25f, 1.0f, 0.25f, 1337, 801, 5234 } },
+    { 0, { 80, 83, 80, 25.0f, false, false, true, 80, 82, 240250, 3496, 9729, 107.900002f, { 4500, 6400, 12600 }, 3600, 10600, { 55.0f, 78.0f, 112.0f }, 0.0500000007f, 1.0f, 1.0f, 1.0f }, { 0.0458897017f, 0.051487416f, 1.0f, 0.0518999062f, 11026, 180, 10600 } },
+    { 0, { 80, 80, 80, 1.0f, false, false, false, 0, 0, 9610, 3496, 9729, 107.900002f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 0.5f, 2.0f, 0.5f, 1.5f }, { 1.0f, 0.25f, 1.0f, 0.75f, 9611, 874, 9729 } },
+    { 0, { 70, 83, 80, 1.20000005f, false, false, false, 0, 0, 6411, 3202, 5234, 64.9000015f, { 4500, 6400, 12600 }, 3600, 10600, { 55.0f, 78.0f, 112.0f }, 0.00100000005f, 0.5f, 1.0f, 0.100000001f }, { 0.0919794142f, 0.00999999978f, 1.0f, 0.0673035383f, 591, 32, 10600 } },
+    { 1, { 80, 80, 80, 1.0f, false, false, false, 0, 0, 9610, 3496, 9729, 107.900002f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 0.5f, 1.0f, 1.0f, 1.0f }, { 1.5f, 0.375f, 1.875f, 0.600000024f, 14416, 1311, 18242 } },
+    { 1, { 70, 83, 80, 1.20000005f, false, false, false, 69, 72, 6411, 3202, 5234, 64.9000015f, { 4500, 6400, 12600 }, 3600, 10600, { 55.0f, 78.0f, 112.0f }, 0.330000013f, 1.0f, 1.0f, 1.0f }, { 1.86788952f, 0.278263569f, 1.875f, 0.683389783f, 11976, 891, 19875 } },
+    { 1, { 73, 83, 80, 2.0f, false, false, true, 0, 0, 14364, 3323, 6000, 93.0f, { 4500, 6400, 12600 }, 3600, 10600, { 55.0f, 78.0f, 112.0f }, 0.75f, 1.10000002f, 0.899999976f, 1.29999995f }, { 4.34210539f, 0.548450172f, 1.875f, 1.40903223f, 62371, 1822, 19875 } },
+    { 1, { 58, 80, 80, 1.0f, false, false, false, 55, 60, 2862, 2676, 3257, 31.1000004f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 0.100000001f, 1.0f, 1.0f, 1.0f }, { 1.47742832f, 0.100000001f, 1.875f, 1.0408361f, 4229, 268, 18242 } },
+    { 1, { 62, 70, 70, 1.0f, false, false, false, 60, 64, 3888, 2812, 3618, 51.4000015f, { 3734, 5342, 5342 }, 3202, 5234, { 45.2000008f, 64.9000015f, 64.9000015f }, 0.600000024f, 1.0f, 1.0f, 1.0f }, { 2.10217595f, 0.512411118f, 1.875f, 0.909105122f, 8174, 1441, 9814 } },
+    { 2, { 70, 83, 80, 1.20000005f, false, false, false, 69, 72, 6411, 3202, 5234, 64.9000015f, { 4500, 6400, 12600 }, 3600, 10600, { 55.0f, 78.0f, 112.0f }, 0.330000013f, 1.0f, 1.0f, 1.0f }, { 0.330000013f, 0.330000013f, 1.0f, 0.330000013f, 2117, 1057, 5234 } },
+    { 2, { 80, 80, 80, 1.0f, false, false, true, 0, 0, 9610, 3496, 9729, 107.900002f, { 4331, 6187, 9610 }, 3496, 9729, { 53.2999992f, 75.8000031f, 107.900002f }, 0.5f, 1.5f, 1.0f, 0.5f }, { 0.75f, 0.5f, 1.0f, 0.25f, 7209, 1748, 9729 } }
+};
+
+bool MatchesGolden(float value, float expected, float tolerance)
+{
+    if (!tolerance)
+        return value == expected;
+
+    return std::fabs(value - expected) <= tolerance * std::max(1.0f, std::fabs(expected));
+}
+
+bool MatchesGolden(uint32 value, uint32 expected, float tolerance)
+{
+    if (!tolerance)
+        return value == expected;
+
+    // a tolerated multiplier difference may still flip the rounding
+    return std::fabs(float(value) - float(expected)) <= tolerance * expected + 1.0f;
+}
+
+// Everything the result of ComputeScaledStats depends on for a creature. The player count,
+// map size, difficulty and boss flag only enter through the default multiplier, the base
+// stats through the template entry, the settings through the generations the scaling and the
+// override of the entry last changed at, so a reload that leaves them alone keeps the results.
+struct ABStatsKey
+{
+    uint32 scalingGeneration;
+    uint32 overrideGeneration;
+    uint32 entry;
+    float defaultMultiplier;
+    uint8 selectedLevel;
+    uint8 mapLevel;
+    uint8 areaMinLevel;
+    uint8 areaMaxLevel;
+    // isRaid, skipLevel and useDefStats
+    uint32 flags;
+
+    bool operator==(ABStatsKey const& other) const
+    {
+        return scalingGeneration == other.scalingGeneration && overrideGeneration == other.overrideGeneration && entry == other.entry && defaultMultiplier == other.defaultMultiplier
+            && selectedLevel == other.selectedLevel && mapLevel == other.mapLevel && areaMinLevel == other.areaMinLevel
+            && areaMaxLevel == other.areaMaxLevel && flags == other.flags;
+    }
+};
+
+// Process wide, fixed size cache of ComputeScaledStats results, shared by all maps. Slots
+// are direct mapped and guarded by a sequence counter: readers never wait, a reader that
+// overlaps a write sees a changed counter and counts a miss, and a writer that finds the
+// slot busy just drops its result. Hits and misses go to the per-thread perf counters.
+class ABStatsCache
+{
+public:
+    // the map threads read the slots without a lock, so only the first call allocates them.
+    // Returns false if a later call asks for another size
+    bool Init(uint32 size)
+    {
+        if (_initialized)
+            return size == _requestedSize;
+
+        _initialized = true;
+        _requestedSize = size;
+        size = std::min(size, MaxSize);
+
+        uint32 slots = 0;
+        if (size)
+            for (slots = 1; slots < size; slots *= 2)
+                ;
+
+        _slots.reset(slots ? new Slot[slots] : nullptr);
+        _mask = slots ? slots - 1 : 0;
+        ResetStats();
+        return true;
+    }
+
+    static uint32 const MaxSize = 1 << 20;
+
+    bool IsEnabled() const { return _slots != nullptr; }
+    uint32 GetSize() const { return _slots ? _mask + 1 : 0; }
+    size_t GetMemoryUsage() const { return GetSize() * sizeof(Slot); }
+
+    bool Find(ABStatsKey const& key, ABScaledStats& stats)
+    {
+        Slot const& slot = _slots[Hash(key) & _mask];
+
+        uint32 sequence = slot.sequence.load(std::memory_order_acquire);
+        if (!(sequence & 1))
+        {
+            uint32 words[KeyWords + StatsWords];
+            for (uint32 i = 0; i < KeyWords + StatsWords; ++i)
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            ABStatsKey slotKey;
+            memcpy(&slotKey, words, sizeof(slotKey));
+
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence && sequence && slotKey == key)
+            {
+                memcpy(&stats, words + KeyWords, sizeof(stats));
+                Perf.Add(AB_PERF_CACHE_HITS);
+                return true;
+            }
+        }
+
+        Perf.Add(AB_PERF_CACHE_MISSES);
+        return false;
+    }
+
+    void Store(ABStatsKey const& key, ABScaledStats const& stats)
+    {
+        Slot& slot = _slots[Hash(key) & _mask];
+
+        uint32 sequence = slot.sequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) || !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire))
+            return;
+
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint32 words[KeyWords + StatsWords];
+        memcpy(words, &key, sizeof(key));
+        memcpy(words + KeyWords, &stats, sizeof(stats));
+        for (uint32 i = 0; i < KeyWords + StatsWords; ++i)
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+        Perf.Add(AB_PERF_CACHE_STORES);
+    }
+
+    // the counters since the last reset, independent of the perf command's reset
+    void GetStats(uint64& hits, uint64& misses, uint64& stores)
+    {
+        ABPerfValues values = Perf.CollectTotals();
+        hits = values.counters[AB_PERF_CACHE_HITS] - _baseline.counters[AB_PERF_CACHE_HITS];
+        misses = values.counters[AB_PERF_CACHE_MISSES] - _baseline.counters[AB_PERF_CACHE_MISSES];
+        stores = values.counters[AB_PERF_CACHE_STORES] - _baseline.counters[AB_PERF_CACHE_STORES];
+    }
+
+    void ResetStats()
+    {
+        _baseline = Perf.CollectTotals();
+    }
+
+private:
+    static uint32 const KeyWords = sizeof(ABStatsKey) / sizeof(uint32);
+    static uint32 const StatsWords = sizeof(ABScaledStats) / sizeof(uint32);
+    static_assert(sizeof(ABStatsKey) % sizeof(uint32) == 0 && sizeof(ABScaledStats) % sizeof(uint32) == 0, "cache slots are copied as words");
+
+    // odd sequence = being written, 0 = never written
+    struct Slot
+    {
+        std::atomic<uint32> sequence{0};
+        std::atomic<uint32> words[KeyWords + StatsWords];
+    };
+
+    static uint32 Hash(ABStatsKey const& key)
+    {
+        uint32 words[KeyWords];
+        memcpy(words, &key, sizeof(key));
+
+        uint32 hash = 2166136261u;
+        for (uint32 word : words)
+            hash = (hash ^ word) * 16777619u;
+
+        return hash ^ (hash >> 15);
+    }
+
+    std::unique_ptr<Slot[]> _slots;
+    uint32 _mask = 0;
+    // perf totals at the last ResetStats
+    ABPerfValues _baseline;
+    bool _initialized = false;
+    uint32 _requestedSize = 0;
+};
+
+static ABStatsCache StatsCache;
+
+ABStatsKey MakeStatsKey(ABConfig const& config, CreatureTemplate const* creatureTemplate, ABCreatureOverride const* creatureOverride, uint8 selectedLevel,
+    uint8 mapLevel, uint8 areaMinLevel, uint8 areaMaxLevel, bool isRaid, bool skipLevel, bool useDefStats, float defaultMultiplier)
+{
+    ABStatsKey key;
+    key.scalingGeneration = config.scalingGeneration;
+    key.overrideGeneration = creatureOverride ? creatureOverride->generation : 0;
+    key.entry = creatureTemplate->Entry;
+    key.defaultMultiplier = defaultMultiplier;
+    key.selectedLevel = selectedLevel;
+    key.mapLevel = mapLevel;
+    key.areaMinLevel = areaMinLevel;
+    key.areaMaxLevel = areaMaxLevel;
+    key.flags = uint32(isRaid) | uint32(skipLevel) << 1 | uint32(useDefStats) << 2;
+    return key;
+}
+
+// Computes the result for a creature of the template and stores it in the cache. Shared by the
+// rescale, the rescale workers and the instance precompute, so all of them agree on the key.
+ABScaledStats ComputeCachedStats(ABConfig const& config, CreatureTemplate const* creatureTemplate, ABCreatureOverride const* creatureOverride, ABStatsKey const& key)
+{
+    ABScaledStats stats;
+    uint8 originalLevel = creatureTemplate->maxlevel;
+    CreatureBaseStats const* origCreatureStats = sObjectMgr->GetCreatureBaseStats(originalLevel, creatureTemplate->unit_class);
+    CreatureBaseStats const* creatureStats = sObjectMgr->GetCreatureBaseStats(key.selectedLevel, creatureTemplate->unit_class);
+
+    ABScalingInput input;
+    input.originalLevel = originalLevel;
+    input.selectedLevel = key.selectedLevel;
+    input.mapLevel = key.mapLevel;
+    input.modHealth = creatureTemplate->ModHealth;
+    input.skipLevel = (key.flags & 2) != 0;
+    input.useDefStats = (key.flags & 4) != 0;
+    input.isRaid = (key.flags & 1) != 0;
+    input.areaMinLevel = key.areaMinLevel;
+    input.areaMaxLevel = key.areaMaxLevel;
+    input.baseHealth = origCreatureStats->GenerateHealth(creatureTemplate);
+    input.baseMana = origCreatureStats->GenerateMana(creatureTemplate);
+    input.baseArmor = origCreatureStats->GenerateArmor(creatureTemplate);
+    input.baseDamage = origCreatureStats->GenerateBaseDamage(creatureTemplate);
+    std::copy(std::begin(creatureStats->BaseHealth), std::end(creatureStats->BaseHealth), input.levelBaseHealth);
+    input.levelMana = creatureStats->GenerateMana(creatureTemplate);
+    input.levelArmor = creatureStats->GenerateArmor(creatureTemplate);
+    std::copy(std::begin(creatureStats->BaseDamage), std::end(creatureStats->BaseDamage), input.levelBaseDamage);
+    input.defaultMultiplier = key.defaultMultiplier;
+    input.overrideHealth = creatureOverride ? creatureOverride->healthMultiplier : 1.0f;
+    input.overrideMana = creatureOverride ? creatureOverride->manaMultiplier : 1.0f;
+    input.overrideDamage = creatureOverride ? creatureOverride->damageMultiplier : 1.0f;
+
+    stats = config.statsKernels[GetStatsKernelIndex(input)](input, config.scaling);
+
+    if (StatsCache.IsEnabled())
+        StatsCache.Store(key, stats);
+
+    return stats;
+}
+
+// the result for a creature of the template, from the cache or computed and stored in it
+ABScaledStats GetScaledStats(ABConfig const& config, CreatureTemplate const* creatureTemplate, ABCreatureOverride const* creatureOverride, ABStatsKey const& key)
+{
+    ABScaledStats stats;
+    if (StatsCache.IsEnabled() && StatsCache.Find(key, stats))
+        return stats;
+
+    return ComputeCachedStats(config, creatureTemplate, creatureOverride, key);
+}
+
+bool IsWithinLevelOffset(ABConfig const& config, uint8 selectedLevel, uint8 targetLevel)
+{
+    return selectedLevel && ((targetLevel >= selectedLevel && targetLevel <= (selectedLevel + config.higherOffset) ) || (targetLevel <= selectedLevel && targetLevel >= (selectedLevel - config.lowerOffset)));
+}
+
+// the group that teleports into a dungeon, used to precompute the instance it creates
+struct ABExpectedGroup
+{
+    uint32 players = 0;
+    uint8 level = 0;
+    uint32 time = 0;
+};
+
+struct ABPrecomputeJob
+{
+    uint32 mapId = 0;
+    uint8 difficulty = 0;
+    ABMapContext context;
+    ABExpectedGroup group;
+};
+
+// Background thread that scales the spawns of a new instance for the group entering it, before
+// the creatures are loaded. The results go to the stats cache, so the map thread only finds and
+// applies them. Reads the same static creature templates the map threads do while loading grids,
+// the spawns come from a copy the world thread hands over.
+class ABPrecomputeWorker
+{
+public:
+    // map id -> spawned entries with their combined spawn masks
+    typedef std::unordered_map<uint32, std::vector<std::pair<uint32, uint32>>> SpawnList;
+
+    ~ABPrecomputeWorker()
+    {
+        Stop();
+    }
+
+    void Queue(ABPrecomputeJob const& job)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_stopped)
+            return;
+
+        if (!_thread.joinable())
+            _thread = std::thread(&ABPrecomputeWorker::Run, this);
+
+        _jobs.push_back(job);
+        _condition.notify_one();
+    }
+
+    // copies the spawns on the world thread, on startup and config reload. Jobs that are already
+    // running keep the previous copy
+    void LoadSpawns()
+    {
+        std::unordered_map<uint32, std::map<uint32, uint32>> spawnMasks;
+        for (auto const& itr : sObjectMgr->GetAllCreatureData())
+            spawnMasks[itr.second.mapid][itr.second.id] |= itr.second.spawnMask;
+
+        std::shared_ptr<SpawnList> spawns = std::make_shared<SpawnList>();
+        for (auto const& itr : spawnMasks)
+            (*spawns)[itr.first].assign(itr.second.begin(), itr.second.end());
+
+        std::lock_guard<std::mutex> guard(_lock);
+        _spawns = spawns;
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stopped = true;
+            _jobs.clear();
+        }
+
+        _condition.notify_one();
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    std::atomic<uint32> jobs{0};
+    std::atomic<uint32> results{0};
+    std::atomic<uint32> lastJobMicroseconds{0};
+
+private:
+    void Run()
+    {
+        while (true)
+        {
+            ABPrecomputeJob job;
+            std::shared_ptr<SpawnList const> spawns;
+            {
+                std::unique_lock<std::mutex> guard(_lock);
+                _condition.wait(guard, [this] { return _stopped || !_jobs.empty(); });
+                if (_stopped)
+                    return;
+
+                job = _jobs.front();
+                _jobs.pop_front();
+                spawns = _spawns;
+            }
+
+            // queued before the world finished loading
+            if (!spawns)
+                continue;
+
+            auto start = std::chrono::steady_clock::now();
+            uint32 computed = Compute(job, *spawns);
+            lastJobMicroseconds.store(uint32(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+            results.fetch_add(computed, std::memory_order_relaxed);
+            jobs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // same difficulty fallback as Creature::InitEntry
+    static CreatureTemplate const* GetDifficultyTemplate(CreatureTemplate const* creatureTemplate, uint8 difficulty, bool isRaid)
+    {
+        for (uint8 diff = difficulty; diff > 0;)
+        {
+            if (creatureTemplate->DifficultyEntry[diff - 1])
+            {
+                if (CreatureTemplate const* difficultyTemplate = sObjectMgr->GetCreatureTemplate(creatureTemplate->DifficultyEntry[diff - 1]))
+                    return difficultyTemplate;
+                break;
+            }
+
+            if (diff >= RAID_DIFFICULTY_10MAN_HEROIC && isRaid)
+                diff -= 2;
+            else
+                break;
+        }
+
+        return creatureTemplate;
+    }
+
+    // mirrors ModifyCreatureAttributes for every spawn, level the template can spawn at and group
+    // size up to the expected one, as players of a group usually arrive one after the other
+    uint32 Compute(ABPrecomputeJob const& job, SpawnList const& spawnList)
+    {
+        auto spawns = spawnList.find(job.mapId);
+        if (spawns == spawnList.end())
+            return 0;
+
+        std::shared_ptr<ABConfig const> snapshot = GetConfigSnapshot();
+        ABConfig const& config = *snapshot;
+        ABMapContext const& context = job.context;
+        uint8 level = job.group.level;
+        uint32 computed = 0;
+
+        for (std::pair<uint32, uint32> const& spawn : spawns->second)
+        {
+            if (!(spawn.second & (1 << job.difficulty)))
+                continue;
+
+            CreatureTemplate const* creatureTemplate = sObjectMgr->GetCreatureTemplate(spawn.first);
+            if (!creatureTemplate)
+                continue;
+
+            creatureTemplate = GetDifficultyTemplate(creatureTemplate, job.difficulty, context.isRaid);
+
+            ABCreatureOverride const* creatureOverride = config.creatureOverrides.Find(creatureTemplate->Entry);
+            int32 forcedNumPlayers = creatureOverride ? creatureOverride->forcedPlayerCount : -1;
+            if (forcedNumPlayers == 0)
+                continue;
+
+            uint32 maxNumberOfPlayers = forcedNumPlayers > 0 ? uint32(forcedNumPlayers) : context.maxPlayers;
+            bool boss = (creatureTemplate->flags_extra & CREATURE_FLAG_EXTRA_DUNGEON_BOSS) != 0;
+            uint8 bonusLevel = creatureTemplate->rank == CREATURE_ELITE_WORLDBOSS ? 3 : 0;
+            uint8 originalLevel = creatureTemplate->maxlevel;
+            bool skipLevel = originalLevel <= 1 && context.lfgMinLevel >= 5;
+            bool scaleLevel = config.LevelScaling && context.isDungeon && !skipLevel && !IsWithinLevelOffset(config, level, originalLevel);
+
+            for (uint32 spawnLevel = creatureTemplate->minlevel; spawnLevel <= creatureTemplate->maxlevel; ++spawnLevel)
+            {
+                uint8 selectedLevel = scaleLevel ? uint8(level + bonusLevel) : uint8(spawnLevel);
+                // with a scaled level this is the same for all spawn levels
+                if (scaleLevel && spawnLevel > creatureTemplate->minlevel)
+                    break;
+
+                bool useDefStats = config.LevelUseDb && selectedLevel >= creatureTemplate->minlevel && selectedLevel <= creatureTemplate->maxlevel;
+
+                for (uint32 players = 1; players <= job.group.players; ++players)
+                {
+                    uint32 count = players + config.PlayerCountDifficultyOffset;
+                    float defaultMultiplier = 1.0f;
+                    if (count < maxNumberOfPlayers)
+                        defaultMultiplier = config.curve.Get(context.inflectionBucket, boss, maxNumberOfPlayers, count);
+
+                    ABStatsKey key = MakeStatsKey(config, creatureTemplate, creatureOverride, selectedLevel, level, context.lfgMinLevel, context.lfgMaxLevel,
+                        context.isRaid, skipLevel, useDefStats, defaultMultiplier);
+                    GetScaledStats(config, creatureTemplate, creatureOverride, key);
+                    ++computed;
+                }
+            }
+        }
+
+        return computed;
+    }
+
+    std::thread _thread;
+    std::mutex _lock;
+    std::condition_variable _condition;
+    std::deque<ABPrecomputeJob> _jobs;
+    bool _stopped = false;
+    // set by LoadSpawns, nothing is precomputed before
+    std::shared_ptr<SpawnList const> _spawns;
+};
+
+static ABPrecomputeWorker PrecomputeWorker;
+
+// filled by the teleport hook, taken by OnCreateMap
+static std::mutex ExpectedGroupsLock;
+static std::unordered_map<uint32, ABExpectedGroup> ExpectedGroups;
+static uint32 const ExpectedGroupTimeout = 30 * IN_MILLISECONDS;
+
+// A rescale whose stats are computed by a worker. The evaluation on the map thread fills in
+// everything but the stats, the apply stage checks it is still the latest one for the creature.
+struct ABRescaleResult
+{
+    uint64 guid = 0;
+    // scaling generation and config stamp the creature was evaluated at
+    uint32 generation = 0;
+    ABConfigStamp configStamp;
+    uint32 instancePlayerCount = 0;
+    ABStatsKey key;
+    CreatureTemplate const* creatureTemplate = nullptr;
+    bool levelChanged = false;
+    // the job was dropped, the creature has to be evaluated again
+    bool failed = false;
+    ABScaledStats stats;
+};
+
+// finished rescales of one map, filled by the workers and drained by its map update
+struct ABRescaleResults
+{
+    std::mutex lock;
+    std::vector<ABRescaleResult> results;
+    // the map is gone, results are dropped
+    bool closed = false;
+};
+
+// number of finished rescales over all maps, lets OnMapUpdate return right away
+static std::atomic<uint32> PendingAsyncResults(0);
+
+struct ABAsyncRescaleStats
+{
+    std::atomic<uint64> queued{0};
+    std::atomic<uint64> applied{0};
+    // superseded by a newer roster change or evaluation, or the creature is gone
+    std::atomic<uint64> outdated{0};
+};
+
+static ABAsyncRescaleStats AsyncRescaleStats;
+
+// Worker pool for the stat math of map wide rescales. A job is pure computation on the current
+// config snapshot and the static creature data, its result goes back to the queue of the map
+// the creature is on and is applied by that map's thread.
+class ABRescaleWorkers
+{
+public:
+    ~ABRescaleWorkers()
+    {
+        Stop();
+    }
+
+    // the thread count is only taken from the first call. Returns false if a later call asks
+    // for another one
+    bool Start(uint32 threads)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_initialized)
+            return threads == _requestedThreads;
+
+        _initialized = true;
+        _requestedThreads = threads;
+        for (uint32 i = 0; i < std::min(threads, MaxThreads); ++i)
+            _threads.emplace_back(&ABRescaleWorkers::Run, this);
+
+        _running.store(!_threads.empty(), std::memory_order_relaxed);
+        return true;
+    }
+
+    static uint32 const MaxThreads = 16;
+
+    bool IsRunning() const { return _running.load(std::memory_order_relaxed); }
+
+    // returns false once the pool is stopped, the caller computes the stats itself
+    bool Queue(std::shared_ptr<ABRescaleResults> const& results, ABRescaleResult const& result)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (_stopped)
+                return false;
+
+            _jobs.emplace_back(results, result);
+        }
+
+        AsyncRescaleStats.queued.fetch_add(1, std::memory_order_relaxed);
+        _condition.notify_one();
+        return true;
+    }
+
+    void Stop()
+    {
+        std::deque<Job> dropped;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stopped = true;
+            dropped.swap(_jobs);
+        }
+
+        for (Job& job : dropped)
+        {
+            job.second.failed = true;
+            Post(job);
+        }
+
+        _running.store(false, std::memory_order_relaxed);
+        _condition.notify_all();
+        for (std::thread& thread : _threads)
+            if (thread.joinable())
+                thread.join();
+    }
+
+private:
+    typedef std::pair<std::shared_ptr<ABRescaleResults>, ABRescaleResult> Job;
+
+    void Run()
+    {
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> guard(_lock);
+                _condition.wait(guard, [this] { return _stopped || !_jobs.empty(); });
+                if (_stopped)
+                    return;
+
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+
+            // the stats are only computed with settings the creature was evaluated with, after a
+            // reload that changed them the creature is evaluated again anyway
+            ABRescaleResult& result = job.second;
+            std::shared_ptr<ABConfig const> snapshot = GetConfigSnapshot();
+            ABConfig const& config = *snapshot;
+            ABCreatureOverride const* creatureOverride = config.creatureOverrides.Find(result.creatureTemplate->Entry);
+            if (config.scalingGeneration != result.key.scalingGeneration || (creatureOverride ? creatureOverride->generation : 0) != result.key.overrideGeneration)
+                result.failed = true;
+            else
+                result.stats = ComputeCachedStats(config, result.creatureTemplate, creatureOverride, result.key);
+
+            Post(job);
+        }
+    }
+
+    static void Post(Job& job)
+    {
+        std::lock_guard<std::mutex> guard(job.first->lock);
+        if (job.first->closed)
+            return;
+
+        job.first->results.push_back(job.second);
+        PendingAsyncResults.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<std::thread> _threads;
+    std::mutex _lock;
+    std::condition_variable _condition;
+    std::deque<Job> _jobs;
+    std::atomic<bool> _running{false};
+    bool _initialized = false;
+    bool _stopped = false;
+    uint32 _requestedThreads = 0;
+};
+
+static ABRescaleWorkers RescaleWorkers;
+
+// checks the kernel against the golden values, tolerance 0 = bit exact.
+// Returns a description of every case that does not match.
+std::vector<std::string> RunScalingSelfTest(float tolerance)
+{
+    std::vector<std::string> failures;
+
+    for (size_t i = 0; i < sizeof(GoldenCases) / sizeof(GoldenCases[0]); ++i)
+    {
+        ABGoldenCase const& golden = GoldenCases[i];
+        ABScaledStats stats = ComputeScaledStats(golden.input, GoldenConfigs[golden.config]);
+        ABScaledStats const& expected = golden.expected;
+
+        if (MatchesGolden(stats.healthMultiplier, expected.healthMultiplier, tolerance)
+            && MatchesGolden(stats.manaMultiplier, expected.manaMultiplier, tolerance)
+            && MatchesGolden(stats.armorMultiplier, expected.armorMultiplier, tolerance)
+            && MatchesGolden(stats.damageMultiplier, expected.damageMultiplier, tolerance)
+            && MatchesGolden(stats.health, expected.health, tolerance)
+            && MatchesGolden(stats.mana, expected.mana, tolerance)
+            && MatchesGolden(stats.armor, expected.armor, tolerance))
+            continue;
+
+        char line[256];
+        snprintf(line, sizeof(line), "case %u: health %u/%u (x%.9g/%.9g), mana %u/%u (x%.9g/%.9g), armor %u/%u, damage x%.9g/%.9g",
+            uint32(i), stats.health, expected.health, stats.healthMultiplier, expected.healthMultiplier,
+            stats.mana, expected.mana, stats.manaMultiplier, expected.manaMultiplier,
+            stats.armor, expected.armor, stats.damageMultiplier, expected.damageMultiplier);
+        failures.push_back(line);
+    }
+
+    return failures;
+}
+
+// Only uses Map members and DBC data, so it is safe to call from OnCreateMap
+// while the map is still being constructed.
+void ABMapContext::Init(Map const* map)
+{
+    isDungeon = map->IsDungeon();
+    isRaid = map->IsRaid();
+    isHeroic = map->IsHeroic();
+    isBattleground = map->IsBattleground();
+
+    // same as InstanceMap::GetMaxPlayers, but also valid for battleground maps
+    MapDifficulty const* mapDiff = GetMapDifficultyData(map->GetId(), map->GetDifficulty());
+    if (mapDiff && mapDiff->maxPlayers)
+        maxPlayers = mapDiff->maxPlayers;
+    else if (map->GetEntry())
+        maxPlayers = map->GetEntry()->maxPlayers;
+
+    inflectionBucket = GetInflectionBucket(isRaid, isHeroic, maxPlayers);
+
+    LFGDungeonEntry const* dungeon = GetLFGDungeon(map->GetId(), map->GetDifficulty());
+    if (dungeon && (isDungeon || isRaid)) {
+        lfgMinLevel = dungeon->minlevel;
+        lfgMaxLevel = dungeon->reclevel ? dungeon->reclevel : dungeon->maxlevel;
+    }
+
+    initialized = true;
+}
+
+void ABMapContext::GetAreaLevel(uint32 areaId, uint8& min, uint8& max)
+{
+    min = lfgMinLevel;
+    max = lfgMaxLevel;
+
+    if (min || max)
+        return;
+
+    uint8 areaLevel = 0;
+    auto itr = std::find_if(areaLevels.begin(), areaLevels.end(), [areaId](std::pair<uint32, uint8> const& area) { return area.first == areaId; });
+    if (itr != areaLevels.end())
+        areaLevel = itr->second;
+    else
+    {
+        AreaTableEntry const* areaEntry = sAreaTableStore.LookupEntry(areaId);
+        if (areaEntry && areaEntry->area_level > 0)
+            areaLevel = areaEntry->area_level;
+
+        areaLevels.emplace_back(areaId, areaLevel);
+    }
+
+    min = areaLevel;
+    max = areaLevel;
+}
+
+// map info with its context, normally set up by OnCreateMap
+AutoBalanceMapInfo* GetMapInfo(Map* map)
+{
+    AutoBalanceMapInfo* mapABInfo = MapInfoKey.FindOrCreate(map->CustomData);
+
+    if (!mapABInfo->context.initialized)
+    {
+        mapABInfo->context.Init(map);
+
+        // immunities only ever apply in dungeons
+        if (mapABInfo->context.isDungeon)
+        {
+            mapABInfo->immunityGeneration = GetConfig().immunityGeneration;
+            DungeonMapInfos.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    return mapABInfo;
+}
+
+// The roster of a map whose creatures are not scaled is not kept, returns nullptr for those.
+// A map that gets scaled by a config reload builds its roster from the player list once.
+ABRoster* GetRoster(Map* map, AutoBalanceMapInfo* mapABInfo)
+{
+    if (!IsScaledMap(map))
+    {
+        if (mapABInfo->roster.IsTracked())
+            mapABInfo->roster.Reset();
+
+        return nullptr;
+    }
+
+    if (!mapABInfo->roster.IsTracked())
+    {
+        mapABInfo->roster.Rebuild(map);
+        if (GetConfig().enabled)
+        {
+            mapABInfo->SetMapLevel(mapABInfo->roster.GetMaxLevel());
+            mapABInfo->SetPlayerCount(mapABInfo->roster.GetPlayerCount());
+        }
+    }
+
+    return &mapABInfo->roster;
+}
+
+// takes one map off the immunity reloads still to be done, never below 0 if a map got two
+void CompleteImmunityReload()
+{
+    uint32 pending = PendingImmunityReloads.load(std::memory_order_relaxed);
+    while (pending && !PendingImmunityReloads.compare_exchange_weak(pending, pending - 1, std::memory_order_relaxed))
+        ;
+}
+
+struct ABImmunity
+{
+    bool ABConfig::*enabled;
+    uint32 spellId;
+    SpellImmunity type;
+    uint32 value;
+};
+
+static ABImmunity const Immunities[] =
+{
+    { &ABConfig::ImmunitiesCharmEnabled,      90000, IMMUNITY_MECHANIC, MECHANIC_CHARM },
+    { &ABConfig::ImmunitiesFearEnabled,       90001, IMMUNITY_MECHANIC, MECHANIC_FEAR },
+    { &ABConfig::ImmunitiesSilenceEnabled,    90002, IMMUNITY_MECHANIC, MECHANIC_SILENCE },
+    { &ABConfig::ImmunitiesSleepEnabled,      90003, IMMUNITY_MECHANIC, MECHANIC_SLEEP },
+    { &ABConfig::ImmunitiesStunEnabled,       90004, IMMUNITY_MECHANIC, MECHANIC_STUN },
+    { &ABConfig::ImmunitiesFreezeEnabled,     90005, IMMUNITY_MECHANIC, MECHANIC_FREEZE },
+    { &ABConfig::ImmunitiesKnockoutEnabled,   90006, IMMUNITY_MECHANIC, MECHANIC_KNOCKOUT },
+    { &ABConfig::ImmunitiesPolymorphEnabled,  90007, IMMUNITY_MECHANIC, MECHANIC_POLYMORPH },
+    { &ABConfig::ImmunitiesHorrorEnabled,     90008, IMMUNITY_MECHANIC, MECHANIC_HORROR },
+    { &ABConfig::ImmunitiesDazeEnabled,       90009, IMMUNITY_MECHANIC, MECHANIC_DAZE },
+    { &ABConfig::ImmunitiesSappedEnabled,     90010, IMMUNITY_MECHANIC, MECHANIC_SAPPED },
+    { &ABConfig::ImmunitiesKnockBackEnabled,  90011, IMMUNITY_EFFECT,   SPELL_EFFECT_KNOCK_BACK },
+    { &ABConfig::ImmunitiesPowerDrainEnabled, 90012, IMMUNITY_EFFECT,   SPELL_EFFECT_POWER_DRAIN }
+};
+
+void ApplyImmunity(Unit* u, bool apply)
+{
+    ABConfig const& config = GetConfig();
+    if (config.PerfEnabled && apply)
+    {
+        AutoBalanceMapInfo const* mapABInfo = u->GetMap() ? MapInfoKey.Find(u->GetMap()->CustomData) : nullptr;
+        CountPerf(mapABInfo ? &mapABInfo->perf : nullptr, AB_PERF_IMMUNITIES);
+    }
+
+    for (ABImmunity const& immunity : Immunities)
+        if (config.*immunity.enabled)
+            u->ApplySpellImmune(immunity.spellId, immunity.type, immunity.value, apply);
+}
+
+// removes the immunities of any config, the enabled ones may have changed since they were applied
+void RemoveAllImmunities(Unit* u)
+{
+    for (ABImmunity const& immunity : Immunities)
+        u->ApplySpellImmune(immunity.spellId, immunity.type, immunity.value, false);
+}
+
+// number of queued immunity checks over all maps, lets OnMapUpdate return right away
+static std::atomic<uint32> PendingImmunityChecks(0);
+
+bool AreImmunitiesActive(AutoBalanceMapInfo const* mapABInfo)
+{
+    ABConfig const& config = GetConfig();
+    return config.ImmunitiesEnabled && mapABInfo->context.isDungeon && mapABInfo->roster.GetPlayerCount() <= config.ImmunitiesMaxPlayers;
+}
+
+void QueueImmunityCheck(AutoBalanceMapInfo* mapABInfo, Player* player)
+{
+    if (std::find(mapABInfo->pendingImmunityChecks.begin(), mapABInfo->pendingImmunityChecks.end(), player) != mapABInfo->pendingImmunityChecks.end())
+        return;
+
+    mapABInfo->pendingImmunityChecks.push_back(player);
+    PendingImmunityChecks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void DequeueImmunityCheck(AutoBalanceMapInfo* mapABInfo, Player* player)
+{
+    auto itr = std::find(mapABInfo->pendingImmunityChecks.begin(), mapABInfo->pendingImmunityChecks.end(), player);
+    if (itr == mapABInfo->pendingImmunityChecks.end())
+        return;
+
+    mapABInfo->pendingImmunityChecks.erase(itr);
+    PendingImmunityChecks.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// number of maps with queued notifications, lets OnMapUpdate return right away
+static std::atomic<uint32> PendingNotifications(0);
+
+// number of maps waiting for their combat to end, lets OnMapUpdate return right away
+static std::atomic<uint32> PendingRescales(0);
+
+void SetRescalePending(AutoBalanceMapInfo* mapABInfo, bool pending)
+{
+    if (mapABInfo->rescalePending == pending)
+        return;
+
+    mapABInfo->rescalePending = pending;
+    if (pending)
+        PendingRescales.fetch_add(1, std::memory_order_relaxed);
+    else
+        PendingRescales.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool ScalesDamage(AutoBalanceMapInfo const* mapABInfo, AutoBalanceCreatureInfo const* creatureABInfo)
+{
+    ABConfig const& config = GetConfig();
+    if (!creatureABInfo->scaled)
+        return false;
+
+    // attacker and target always share the map, so the map type of the attacker is enough
+    return !config.DungeonsOnly || mapABInfo->context.isDungeon || mapABInfo->context.isBattleground;
+}
+
+// number of maps in a rescale wave, lets OnMapUpdate return right away
+static std::atomic<uint32> ActiveRescaleWaves(0);
+
+// false if the creature has to wait for a later map update, see ABRescaleBudget
+bool CanRescale(Creature* creature, AutoBalanceMapInfo* mapABInfo)
+{
+    ABConfig const& config = GetConfig();
+    ABRescaleBudget& budget = mapABInfo->rescaleBudget;
+
+    if (creature->IsInCombat())
+        return true;
+
+    // the player distance only matters once half of the budget is spent
+    if (!budget.IsSpent(false, config.RescaleBudgetCreatures, config.RescaleBudgetMicroseconds))
+        return true;
+
+    if (budget.IsSpent(mapABInfo->roster.IsNearPlayer(creature, config.RescaleNearDistance), config.RescaleBudgetCreatures, config.RescaleBudgetMicroseconds))
+    {
+        budget.Defer();
+        return false;
+    }
+
+    return true;
+}
+
+// charges the time of one creature rescale to the map's budget
+class ABRescaleTimer
+{
+public:
+    explicit ABRescaleTimer(AutoBalanceMapInfo* mapABInfo) : _mapABInfo(mapABInfo), _start(std::chrono::steady_clock::now()) {}
+
+    ~ABRescaleTimer()
+    {
+        uint64 elapsed = uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+        if (_mapABInfo->rescaleBudget.AddRescale(uint32(elapsed / 1000), getMSTime()))
+            ActiveRescaleWaves.fetch_add(1, std::memory_order_relaxed);
+
+        if (IsPerfEnabled())
+        {
+            CountPerf(&_mapABInfo->perf, AB_PERF_RESCALES);
+            Perf.Record(AB_PERF_TIME_RESCALE, elapsed);
+            _mapABInfo->perf.timeSum[AB_PERF_TIME_RESCALE].fetch_add(elapsed, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    AutoBalanceMapInfo* _mapABInfo;
+    std::chrono::steady_clock::time_point _start;
+};
+
+// queues a notification for all players on the map, see ABNotifier
+void NotifyMap(AutoBalanceMapInfo* mapABInfo, const char* format, ...)
+{
+    char message[512];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+
+    if (mapABInfo->notifier.Queue(message, getMSTime()))
+        PendingNotifications.fetch_add(1, std::memory_order_relaxed);
+}
+
+// builds the packet once and sends it to every player on the map
+void FlushNotifications(Map* map, AutoBalanceMapInfo* mapABInfo)
+{
+    ABConfig const& config = GetConfig();
+    uint32 now = getMSTime();
+    if (!mapABInfo->notifier.IsDue(now, config.NotifyMergeWindow, config.NotifyMinInterval))
+        return;
+
+    ABTraceScope traceScope(AB_TRACE_NOTIFY, map, mapABInfo->notifier.GetPendingCount());
+    WorldPacket data;
+    ChatHandler::BuildChatPacket(data, CHAT_MSG_SYSTEM, LANG_UNIVERSAL, nullptr, nullptr, mapABInfo->notifier.Take(now));
+    map->SendToPlayers(&data);
+    PendingNotifications.fetch_sub(1, std::memory_order_relaxed);
+
+    if (config.PerfEnabled)
+        CountPerf(&mapABInfo->perf, AB_PERF_NOTIFICATIONS);
+}
+
+// the global counters of work queued on this map have to drop it with the map
+AutoBalanceMapInfo::~AutoBalanceMapInfo()
+{
+    MapInfoKey.Invalidate();
+
+    if (asyncResults)
+    {
+        std::lock_guard<std::mutex> guard(asyncResults->lock);
+        asyncResults->closed = true;
+        PendingAsyncResults.fetch_sub(uint32(asyncResults->results.size()), std::memory_order_relaxed);
+        asyncResults->results.clear();
+    }
+
+    if (!pendingImmunityChecks.empty())
+        PendingImmunityChecks.fetch_sub(uint32(pendingImmunityChecks.size()), std::memory_order_relaxed);
+
+    if (notifier.IsPending())
+        PendingNotifications.fetch_sub(1, std::memory_order_relaxed);
+
+    if (rescalePending)
+        PendingRescales.fetch_sub(1, std::memory_order_relaxed);
+
+    if (rescaleBudget.IsInWave())
+        ActiveRescaleWaves.fetch_sub(1, std::memory_order_relaxed);
 
-    return ret;
+    if (!immunityGeneration)
+        return;
+
+    DungeonMapInfos.fetch_sub(1, std::memory_order_relaxed);
+    if (immunityGeneration != GetConfig().immunityGeneration)
+        CompleteImmunityReload();
 }
 
-bool ABScriptMgr::OnAfterDefaultMultiplier(Creature *creature, float & defaultMultiplier) {
-    bool ret=true;
-    FOR_SCRIPTS_RET(ABModuleScript, itr, end, ret) // return true by default if not scripts
-    if (!itr->second->OnAfterDefaultMultiplier(creature, defaultMultiplier))
-        ret=false; // we change ret value only when scripts return false
+// removes the auras the mechanic immunities did not prevent
+void EnforceImmunities(Player* player)
+{
+    ABConfig const& config = GetConfig();
+    if (config.ImmunitiesCharmEnabled && player->HasAuraType(SPELL_AURA_MOD_CHARM))
+        if (Unit* charmer = player->GetCharmerOrOwner())
+        {
+            player->RemoveAurasByType(SPELL_AURA_MOD_CHARM);
+            charmer->SetInCombatWith(player);
+            charmer->AddThreat(player, 1); // add threat to prevent the charmer from evading
+        }
 
-    return ret;
-}
+    if (config.ImmunitiesSilenceEnabled && player->HasAuraType(SPELL_AURA_MOD_SILENCE))
+        player->RemoveAurasByType(SPELL_AURA_MOD_SILENCE);
 
-bool ABScriptMgr::OnBeforeUpdateStats(Creature* creature, uint32& scaledHealth, uint32& scaledMana, float& damageMultiplier, uint32& newBaseArmor) {
-    bool ret=true;
-    FOR_SCRIPTS_RET(ABModuleScript, itr, end, ret)
-    if (!itr->second->OnBeforeUpdateStats(creature, scaledHealth, scaledMana, damageMultiplier, newBaseArmor))
-        ret=false;
+    if (config.ImmunitiesFearEnabled)
+    {
+        if (player->HasAuraType(SPELL_AURA_MOD_FEAR))
+            player->RemoveAurasByType(SPELL_AURA_MOD_FEAR);
 
-    return ret;
+        if (config.ImmunitiesPetEnabled)
+            if (Pet* pet = player->GetPet())
+                if (pet->HasAuraType(SPELL_AURA_MOD_FEAR))
+                    pet->RemoveAurasByType(SPELL_AURA_MOD_FEAR);
+    }
 }
 
-ABModuleScript::ABModuleScript(const char* name)
-    : ModuleScript(name)
+// The apply stage of a rescale: sets the scaled stats on the creature, always on its map thread
+void ApplyScaledStats(AutoBalanceMapInfo* mapABInfo, Creature* creature, AutoBalanceCreatureInfo* creatureABInfo, ABScaledStats const& stats,
+    uint32 instancePlayerCount, float defaultMultiplier, bool levelChanged)
 {
-    ScriptRegistry<ABModuleScript>::AddScript(this);
-}
+    ABConfig const& config = GetConfig();
+    ABPerfScope perfScope(AB_PERF_TIME_APPLY, &mapABInfo->perf);
+    ABTraceScope traceScope(AB_TRACE_APPLY, creature->GetMap(), creature->GetEntry());
+
+    creatureABInfo->asyncPending = false;
+    if (levelChanged)
+        creature->SetLevel(creatureABInfo->selectedLevel);
+
+    ABScalingContext scalingContext;
+    scalingContext.creature = creature;
+    scalingContext.instancePlayerCount = instancePlayerCount;
+    scalingContext.defaultMultiplier = defaultMultiplier;
+    scalingContext.scaledHealth = stats.health;
+    scalingContext.scaledMana = stats.mana;
+    scalingContext.damageMultiplier = stats.damageMultiplier;
+    scalingContext.newBaseArmor = stats.armor;
+
+    // a vetoed rescale keeps the multipliers of the stats the creature still has
+    if (!sABScriptMgr->OnScalingStats(scalingContext))
+        return;
+
+    creatureABInfo->HealthMultiplier = stats.healthMultiplier;
+    creatureABInfo->ManaMultiplier = stats.manaMultiplier;
+    creatureABInfo->ArmorMultiplier = stats.armorMultiplier;
+
+    uint32 scaledHealth = scalingContext.scaledHealth;
+    uint32 scaledMana = scalingContext.scaledMana;
+    float damageMul = scalingContext.damageMultiplier;
+    uint32 newBaseArmor = scalingContext.newBaseArmor;
+
+    uint32 prevMaxHealth = creature->GetMaxHealth();
+    uint32 prevMaxPower = creature->GetMaxPower(POWER_MANA);
+    uint32 prevHealth = creature->GetHealth();
+    uint32 prevPower = creature->GetPower(POWER_MANA);
+
+    Powers pType= creature->getPowerType();
+
+    // every setter marks update fields dirty, so only the values that moved are set.
+    // A spawn or respawn starts from the template stats and gets all of them
+    bool fullApply = !creatureABInfo->applied;
+    bool healthChanged = fullApply || creatureABInfo->appliedHealth != scaledHealth;
+    bool manaChanged = fullApply || creatureABInfo->appliedMana != scaledMana;
+    bool armorChanged = fullApply || creatureABInfo->appliedArmor != newBaseArmor;
+
+    if (armorChanged)
+    {
+        creature->SetArmor(newBaseArmor);
+        creature->SetModifierValue(UNIT_MOD_ARMOR, BASE_VALUE, (float)newBaseArmor);
+    }
 
+    if (healthChanged)
+    {
+        creature->SetCreateHealth(scaledHealth);
+        creature->SetMaxHealth(scaledHealth);
+        creature->ResetPlayerDamageReq();
+        creature->SetModifierValue(UNIT_MOD_HEALTH, BASE_VALUE, (float)scaledHealth);
+    }
 
-class AutoBalanceCreatureInfo : public DataMap::Base
-{
-public:
-    AutoBalanceCreatureInfo() {}
-    AutoBalanceCreatureInfo(uint32 count, float dmg, float hpRate, float manaRate, float armorRate, uint8 selLevel) :
-    instancePlayerCount(count),selectedLevel(selLevel), DamageMultiplier(dmg),HealthMultiplier(hpRate),ManaMultiplier(manaRate),ArmorMultiplier(armorRate) {}
-    uint32 instancePlayerCount = 0;
-    uint8 selectedLevel = 0;
-    // this is used to detect creatures that update their entry
-    uint32 entry = 0;
-    float DamageMultiplier = 1;
-    float HealthMultiplier = 1;
-    float ManaMultiplier = 1;
-    float ArmorMultiplier = 1;
-};
+    if (manaChanged)
+    {
+        creature->SetCreateMana(scaledMana);
+        creature->SetMaxPower(POWER_MANA, scaledMana);
+        creature->SetModifierValue(UNIT_MOD_MANA, BASE_VALUE, (float)scaledMana);
+    }
 
-class AutoBalanceMapInfo : public DataMap::Base
-{
-public:
-    AutoBalanceMapInfo() {}
-    AutoBalanceMapInfo(uint32 count, uint8 selLevel) : playerCount(count),mapLevel(selLevel) {}
-    uint32 playerCount = 0;
-    uint8 mapLevel = 0;
-};
+    if (fullApply)
+    {
+        creature->SetModifierValue(UNIT_MOD_ENERGY, BASE_VALUE, (float)100.0f);
+        creature->SetModifierValue(UNIT_MOD_RAGE, BASE_VALUE, (float)100.0f);
+    }
 
-// The map values correspond with the .AutoBalance.XX.Name entries in the configuration file.
-static std::map<int, int> forcedCreatureIds;
-// cheaphack for difficulty server-wide.
-// Another value TODO in player class for the party leader's value to determine dungeon difficulty.
-static int8 PlayerCountDifficultyOffset, LevelScaling, higherOffset, lowerOffset;
-static uint32 rewardRaid, rewardDungeon, MinPlayerReward, ImmunitiesMaxPlayers;
-static bool enabled, LevelEndGameBoost, DungeonsOnly, PlayerChangeNotify, LevelUseDb, rewardEnabled, DungeonScaleDownXP, ImmunitiesEnabled, ImmunitiesPetEnabled, ImmunitiesCharmEnabled, ImmunitiesFearEnabled, ImmunitiesSilenceEnabled, ImmunitiesSleepEnabled, ImmunitiesStunEnabled, ImmunitiesFreezeEnabled, ImmunitiesKnockoutEnabled, ImmunitiesPolymorphEnabled, ImmunitiesHorrorEnabled, ImmunitiesDazeEnabled, ImmunitiesSappedEnabled, ImmunitiesKnockBackEnabled, ImmunitiesPowerDrainEnabled;
-static float globalRate, healthMultiplier, manaMultiplier, armorMultiplier, damageMultiplier, MinHPModifier, MinManaModifier, MinDamageModifier,
-InflectionPoint, InflectionPointRaid, InflectionPointRaid10M, InflectionPointRaid25M, InflectionPointHeroic, InflectionPointRaidHeroic, InflectionPointRaid10MHeroic, InflectionPointRaid25MHeroic, BossInflectionMult;
+    // the damage multiplier is only read by the damage hooks
+    creatureABInfo->DamageMultiplier = damageMul;
+    creatureABInfo->scaled = damageMul != 1;
 
-int GetValidDebugLevel()
-{
-    int debugLevel = sConfigMgr->GetIntDefault("AutoBalance.DebugLevel", 2);
+    if (healthChanged)
+    {
+        uint32 scaledCurHealth=prevHealth && prevMaxHealth ? float(scaledHealth)/float(prevMaxHealth)*float(prevHealth) : 0;
+        creature->SetHealth(scaledCurHealth);
+    }
 
-    if ((debugLevel < 0) || (debugLevel > 3))
-        {
-        return 1;
-        }
-    return debugLevel;
-}
+    if (manaChanged)
+    {
+        uint32 scaledCurPower=prevPower && prevMaxPower  ? float(scaledMana)/float(prevMaxPower)*float(prevPower) : 0;
+        if (pType == POWER_MANA)
+            creature->SetPower(POWER_MANA, scaledCurPower);
+        else
+            creature->setPowerType(pType); // fix creatures with different power types
+    }
 
-void LoadForcedCreatureIdsFromString(std::string creatureIds, int forcedPlayerCount) // Used for reading the string from the configuration file to for those creatures who need to be scaled for XX number of players.
-{
-    std::string delimitedValue;
-    std::stringstream creatureIdsStream;
+    creatureABInfo->applied = true;
+    creatureABInfo->appliedHealth = scaledHealth;
+    creatureABInfo->appliedMana = scaledMana;
+    creatureABInfo->appliedArmor = newBaseArmor;
 
-    creatureIdsStream.str(creatureIds);
-    while (std::getline(creatureIdsStream, delimitedValue, ',')) // Process each Creature ID in the string, delimited by the comma - ","
+    bool statsMoved = healthChanged || manaChanged || armorChanged || levelChanged;
+
+    if (config.HookStatsEnabled)
     {
-        int creatureId = atoi(delimitedValue.c_str());
-        if (creatureId >= 0)
-        {
-            forcedCreatureIds[creatureId] = forcedPlayerCount;
-        }
+        uint32 changedFields = uint32(healthChanged) + uint32(manaChanged) + uint32(armorChanged);
+        HookStats.appliedFields.fetch_add(changedFields, std::memory_order_relaxed);
+        HookStats.skippedFields.fetch_add(3 - changedFields, std::memory_order_relaxed);
+        (statsMoved ? HookStats.statUpdates : HookStats.skippedStatUpdates).fetch_add(1, std::memory_order_relaxed);
     }
+
+    if (statsMoved)
+        creature->UpdateAllStats();
+
+    AB_LOG_DEBUG("AutoBalance: map %u instance %u creature entry %u scaled for %u players at level %u: health %u, mana %u, damage x%.3f",
+        creature->GetMapId(), creature->GetInstanceId(), creature->GetEntry(), instancePlayerCount, uint32(creatureABInfo->selectedLevel),
+        scaledHealth, scaledMana, double(damageMul));
 }
 
-int GetForcedNumPlayers(int creatureId)
+// Hands the stat math of a rescale to the workers. Spawns are always scaled right away, and a
+// result the cache already has is cheaper to apply than to send around
+bool QueueAsyncRescale(AutoBalanceMapInfo* mapABInfo, Creature* creature, AutoBalanceCreatureInfo* creatureABInfo, CreatureTemplate const* creatureTemplate,
+    ABStatsKey const& key, bool levelChanged)
 {
-    if (forcedCreatureIds.find(creatureId) == forcedCreatureIds.end()) // Don't want the forcedCreatureIds map to blowup to a massive empty array
+    ABConfig const& config = GetConfig();
+    if (!config.AsyncRescaleThreads || !RescaleWorkers.IsRunning())
+        return false;
+
+    if (!mapABInfo->asyncResults)
+        mapABInfo->asyncResults = std::make_shared<ABRescaleResults>();
+
+    ABRescaleResult result;
+    result.guid = creature->GetGUID();
+    result.generation = creatureABInfo->generation;
+    result.configStamp = creatureABInfo->configStamp;
+    result.instancePlayerCount = creatureABInfo->instancePlayerCount;
+    result.key = key;
+    result.creatureTemplate = creatureTemplate;
+    result.levelChanged = levelChanged;
+
+    if (!RescaleWorkers.Queue(mapABInfo->asyncResults, result))
+        return false;
+
+    creatureABInfo->asyncPending = true;
+    return true;
+}
+
+// The apply stage for the rescales the workers have finished. A result is only applied if it is
+// still the latest evaluation of a creature that is alive on the map at the current roster
+void ApplyAsyncRescales(Map* map, AutoBalanceMapInfo* mapABInfo)
+{
+    std::vector<ABRescaleResult> results;
     {
-        return -1;
+        std::lock_guard<std::mutex> guard(mapABInfo->asyncResults->lock);
+        results.swap(mapABInfo->asyncResults->results);
     }
-    return forcedCreatureIds[creatureId];
-}
 
+    if (results.empty())
+        return;
 
-void getAreaLevel(Map *map, uint8 areaid, uint8 &min, uint8 &max) {
-    LFGDungeonEntry const* dungeon = GetLFGDungeon(map->GetId(), map->GetDifficulty());
-    if (dungeon && (map->IsDungeon() || map->IsRaid())) {
-        min  = dungeon->minlevel;
-        max  = dungeon->reclevel ? dungeon->reclevel : dungeon->maxlevel;
-    }
+    PendingAsyncResults.fetch_sub(uint32(results.size()), std::memory_order_relaxed);
+    ABTraceScope traceScope(AB_TRACE_APPLY_RESULTS, map, uint32(results.size()));
 
-    if (!min && !max)
+    uint32 generation = GetScalingGeneration(mapABInfo);
+    uint32 applied = 0;
+
+    for (ABRescaleResult const& result : results)
     {
-        AreaTableEntry const* areaEntry = sAreaTableStore.LookupEntry(areaid);
-        if (areaEntry && areaEntry->area_level > 0) {
-            min = areaEntry->area_level;
-            max = areaEntry->area_level;
+        Creature* creature = map->GetCreature(result.guid);
+        AutoBalanceCreatureInfo* creatureABInfo = creature ? mapABInfo->creatures.Find(result.guid) : nullptr;
+
+        // a dropped job of the latest evaluation, the next update evaluates the creature again
+        if (result.failed)
+        {
+            if (creatureABInfo && creatureABInfo->asyncPending && creatureABInfo->generation == result.generation
+                && creatureABInfo->configStamp == result.configStamp)
+            {
+                creatureABInfo->generation = 0;
+                creatureABInfo->asyncPending = false;
+            }
+
+            continue;
         }
+
+        if (!creatureABInfo || !creatureABInfo->asyncPending || !creature->IsAlive() || result.generation != generation
+            || creatureABInfo->generation != result.generation || creatureABInfo->configStamp != result.configStamp
+            || creatureABInfo->selectedLevel != result.key.selectedLevel)
+            continue;
+
+        ApplyScaledStats(mapABInfo, creature, creatureABInfo, result.stats, result.instancePlayerCount, result.key.defaultMultiplier, result.levelChanged);
+        ++applied;
     }
-}
 
-void ApplyImmunity(Unit* u, bool apply)
-{
-    if (ImmunitiesCharmEnabled)
-        u->ApplySpellImmune(90000, IMMUNITY_MECHANIC, MECHANIC_CHARM, apply);
-    if (ImmunitiesFearEnabled)
-        u->ApplySpellImmune(90001, IMMUNITY_MECHANIC, MECHANIC_FEAR, apply);
-    if (ImmunitiesSilenceEnabled)
-        u->ApplySpellImmune(90002, IMMUNITY_MECHANIC, MECHANIC_SILENCE, apply);
-    if (ImmunitiesSleepEnabled)
-        u->ApplySpellImmune(90003, IMMUNITY_MECHANIC, MECHANIC_SLEEP, apply);
-    if (ImmunitiesStunEnabled)
-        u->ApplySpellImmune(90004, IMMUNITY_MECHANIC, MECHANIC_STUN, apply);
-    if (ImmunitiesFreezeEnabled)
-        u->ApplySpellImmune(90005, IMMUNITY_MECHANIC, MECHANIC_FREEZE, apply);
-    if (ImmunitiesKnockoutEnabled)
-        u->ApplySpellImmune(90006, IMMUNITY_MECHANIC, MECHANIC_KNOCKOUT, apply);
-    if (ImmunitiesPolymorphEnabled)
-        u->ApplySpellImmune(90007, IMMUNITY_MECHANIC, MECHANIC_POLYMORPH, apply);
-    if (ImmunitiesHorrorEnabled)
-        u->ApplySpellImmune(90008, IMMUNITY_MECHANIC, MECHANIC_HORROR, apply);
-    if (ImmunitiesDazeEnabled)
-        u->ApplySpellImmune(90009, IMMUNITY_MECHANIC, MECHANIC_DAZE, apply);
-    if (ImmunitiesSappedEnabled)
-        u->ApplySpellImmune(90010, IMMUNITY_MECHANIC, MECHANIC_SAPPED, apply);
-    if (ImmunitiesKnockBackEnabled)
-        u->ApplySpellImmune(90011, IMMUNITY_EFFECT, SPELL_EFFECT_KNOCK_BACK, apply);
-    if (ImmunitiesPowerDrainEnabled)
-        u->ApplySpellImmune(90012, IMMUNITY_EFFECT, SPELL_EFFECT_POWER_DRAIN, apply);
+    AsyncRescaleStats.applied.fetch_add(applied, std::memory_order_relaxed);
+    AsyncRescaleStats.outdated.fetch_add(results.size() - applied, std::memory_order_relaxed);
+
+    if (applied != results.size())
+        AB_LOG_DEBUG("AutoBalance: map %u instance %u dropped %u outdated rescale results.", map->GetId(), map->GetInstanceId(), uint32(results.size() - applied));
 }
 
 class AutoBalance_WorldScript : public WorldScript
@@ -195,75 +3852,151 @@ class AutoBalance_WorldScript : public WorldScript
     {
     }
 
-    void OnBeforeConfigLoad(bool /*reload*/) override
+    void OnBeforeConfigLoad(bool reload) override
     {
         SetInitialWorldSettings();
+
+        // on startup the creature data is not loaded yet, see OnStartup
+        if (reload && GetConfig().PrecomputeEnabled)
+            PrecomputeWorker.LoadSpawns();
     }
     void OnStartup() override
     {
+        if (GetConfig().PrecomputeEnabled)
+            PrecomputeWorker.LoadSpawns();
+    }
+
+    void OnUpdate(uint32 diff) override
+    {
+        ABConfig const& config = GetConfig();
+        if (!config.PerfEnabled || config.PerfDumpFile.empty())
+            return;
+
+        _perfDumpTimer += diff;
+        if (_perfDumpTimer < config.PerfDumpInterval * IN_MILLISECONDS)
+            return;
+
+        _perfDumpTimer = 0;
+        WritePerfDump(config.PerfDumpFile);
+    }
+
+    void OnShutdown() override
+    {
+        PrecomputeWorker.Stop();
+        RescaleWorkers.Stop();
+        TraceRecorder.Shutdown();
+        LogQueue.Stop();
     }
 
     void SetInitialWorldSettings()
     {
-        forcedCreatureIds.clear();
-        LoadForcedCreatureIdsFromString(sConfigMgr->GetStringDefault("AutoBalance.ForcedID40", ""), 40);
-        LoadForcedCreatureIdsFromString(sConfigMgr->GetStringDefault("AutoBalance.ForcedID25", ""), 25);
-        LoadForcedCreatureIdsFromString(sConfigMgr->GetStringDefault("AutoBalance.ForcedID10", ""), 10);
-        LoadForcedCreatureIdsFromString(sConfigMgr->GetStringDefault("AutoBalance.ForcedID5", ""), 5);
-        LoadForcedCreatureIdsFromString(sConfigMgr->GetStringDefault("AutoBalance.ForcedID2", ""), 2);
-        LoadForcedCreatureIdsFromString(sConfigMgr->GetStringDefault("AutoBalance.DisabledID", ""), 0);
-
-        enabled = sConfigMgr->GetBoolDefault("AutoBalance.enable", true);
-        LevelEndGameBoost = sConfigMgr->GetBoolDefault("AutoBalance.LevelEndGameBoost", true);
-        DungeonsOnly = sConfigMgr->GetBoolDefault("AutoBalance.DungeonsOnly", true);
-        PlayerChangeNotify = sConfigMgr->GetBoolDefault("AutoBalance.PlayerChangeNotify", true);
-        LevelUseDb = sConfigMgr->GetBoolDefault("AutoBalance.levelUseDbValuesWhenExists", true);
-        rewardEnabled = sConfigMgr->GetBoolDefault("AutoBalance.reward.enable", true);
-        DungeonScaleDownXP = sConfigMgr->GetBoolDefault("AutoBalance.DungeonScaleDownXP", false);
-
-        ImmunitiesEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Enable", false);
-        ImmunitiesPetEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Pet.Enable", false);
-        ImmunitiesMaxPlayers = sConfigMgr->GetIntDefault("AutoBalance.Immunities.MaxPlayers", 3);
-        ImmunitiesCharmEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Charm.Enable", true);
-        ImmunitiesFearEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Fear.Enable", true);
-        ImmunitiesSilenceEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Silence.Enable", true);
-        ImmunitiesSleepEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Sleep.Enable", true);
-        ImmunitiesStunEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Stun.Enable", true);
-        ImmunitiesFreezeEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Freeze.Enable", true);
-        ImmunitiesKnockoutEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Knockout.Enable", true);
-        ImmunitiesPolymorphEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Polymorph.Enable", true);
-        ImmunitiesHorrorEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Horror.Enable", true);
-        ImmunitiesDazeEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Daze.Enable", true);
-        ImmunitiesSappedEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Sapped.Enable", true);
-        ImmunitiesKnockBackEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.KnockBack.Enable", true);
-        ImmunitiesPowerDrainEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.PowerDrain.Enable", true);
-
-        LevelScaling = sConfigMgr->GetIntDefault("AutoBalance.levelScaling", 1);
-        PlayerCountDifficultyOffset = sConfigMgr->GetIntDefault("AutoBalance.playerCountDifficultyOffset", 0);
-        higherOffset = sConfigMgr->GetIntDefault("AutoBalance.levelHigherOffset", 3);
-        lowerOffset = sConfigMgr->GetIntDefault("AutoBalance.levelLowerOffset", 0);
-        rewardRaid = sConfigMgr->GetIntDefault("AutoBalance.reward.raidToken", 49426);
-        rewardDungeon = sConfigMgr->GetIntDefault("AutoBalance.reward.dungeonToken", 47241);
-        MinPlayerReward = sConfigMgr->GetFloatDefault("AutoBalance.reward.MinPlayerReward", 1);
-
-        InflectionPoint = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPoint", 0.5f);
-        InflectionPointRaid = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid", InflectionPoint);
-        InflectionPointRaid25M = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid25M", InflectionPointRaid);
-        InflectionPointRaid10M = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid10M", InflectionPointRaid);
-        InflectionPointHeroic = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointHeroic", InflectionPoint);
-        InflectionPointRaidHeroic = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaidHeroic", InflectionPointRaid);
-        InflectionPointRaid25MHeroic = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid25MHeroic", InflectionPointRaid25M);
-        InflectionPointRaid10MHeroic = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid10MHeroic", InflectionPointRaid10M);
-        BossInflectionMult = sConfigMgr->GetFloatDefault("AutoBalance.BossInflectionMult", 1.0f);
-        globalRate = sConfigMgr->GetFloatDefault("AutoBalance.rate.global", 1.0f);
-        healthMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.health", 1.0f);
-        manaMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.mana", 1.0f);
-        armorMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.armor", 1.0f);
-        damageMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.damage", 1.0f);
-        MinHPModifier = sConfigMgr->GetFloatDefault("AutoBalance.MinHPModifier", 0.1f);
-        MinManaModifier = sConfigMgr->GetFloatDefault("AutoBalance.MinManaModifier", 0.1f);
-        MinDamageModifier = sConfigMgr->GetFloatDefault("AutoBalance.MinDamageModifier", 0.1f);
+        // parsed into a new snapshot, the one in use is not touched until it is replaced
+        std::unique_ptr<ABConfig> config(new ABConfig());
+
+        // later lists take precedence, so DisabledID always wins
+        std::map<uint32, ABCreatureOverride> overrides;
+        LoadForcedCreatureIdsFromString(overrides, sConfigMgr->GetStringDefault("AutoBalance.ForcedID40", ""), 40, "AutoBalance.ForcedID40");
+        LoadForcedCreatureIdsFromString(overrides, sConfigMgr->GetStringDefault("AutoBalance.ForcedID25", ""), 25, "AutoBalance.ForcedID25");
+        LoadForcedCreatureIdsFromString(overrides, sConfigMgr->GetStringDefault("AutoBalance.ForcedID10", ""), 10, "AutoBalance.ForcedID10");
+        LoadForcedCreatureIdsFromString(overrides, sConfigMgr->GetStringDefault("AutoBalance.ForcedID5", ""), 5, "AutoBalance.ForcedID5");
+        LoadForcedCreatureIdsFromString(overrides, sConfigMgr->GetStringDefault("AutoBalance.ForcedID2", ""), 2, "AutoBalance.ForcedID2");
+        LoadForcedCreatureIdsFromString(overrides, sConfigMgr->GetStringDefault("AutoBalance.DisabledID", ""), 0, "AutoBalance.DisabledID");
+
+        LoadCreatureOverridesFromString(overrides, sConfigMgr->GetStringDefault("AutoBalance.CreatureOverrides", ""));
+        std::string overridesFile = sConfigMgr->GetStringDefault("AutoBalance.CreatureOverridesFile", "");
+        if (!overridesFile.empty())
+            LoadCreatureOverridesFromFile(overrides, overridesFile);
+
+        config->creatureOverrides.Build(overrides);
+
+        config->enabled = sConfigMgr->GetBoolDefault("AutoBalance.enable", true);
+        config->scaling.levelEndGameBoost = sConfigMgr->GetBoolDefault("AutoBalance.LevelEndGameBoost", true);
+        config->DungeonsOnly = sConfigMgr->GetBoolDefault("AutoBalance.DungeonsOnly", true);
+        config->HookStatsEnabled = sConfigMgr->GetBoolDefault("AutoBalance.HookStats", false);
+        config->DebugLevel = GetValidDebugLevel();
+        LogQueue.Start();
+        config->PerfEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Perf.Enable", false);
+        config->PerfDumpFile = sConfigMgr->GetStringDefault("AutoBalance.Perf.DumpFile", "");
+        config->PerfDumpInterval = std::max(sConfigMgr->GetIntDefault("AutoBalance.Perf.DumpInterval", 60), 1);
+        config->TraceBufferSize = std::max(sConfigMgr->GetIntDefault("AutoBalance.Trace.BufferSize", 65536), 0);
+        config->TraceDirectory = sConfigMgr->GetStringDefault("AutoBalance.Trace.Directory", ".");
+        config->PlayerChangeNotify = sConfigMgr->GetBoolDefault("AutoBalance.PlayerChangeNotify", true);
+        config->RescaleBudgetCreatures = sConfigMgr->GetIntDefault("AutoBalance.RescaleBudget.Creatures", 50);
+        config->RescaleBudgetMicroseconds = sConfigMgr->GetIntDefault("AutoBalance.RescaleBudget.Microseconds", 0);
+        config->RescaleNearDistance = sConfigMgr->GetFloatDefault("AutoBalance.RescaleBudget.NearDistance", 60.0f);
+        config->NotifyMergeWindow = sConfigMgr->GetIntDefault("AutoBalance.PlayerChangeNotify.MergeWindow", 500);
+        config->NotifyMinInterval = sConfigMgr->GetIntDefault("AutoBalance.PlayerChangeNotify.MinInterval", 2000);
+        config->LevelUseDb = sConfigMgr->GetBoolDefault("AutoBalance.levelUseDbValuesWhenExists", true);
+        config->rewardEnabled = sConfigMgr->GetBoolDefault("AutoBalance.reward.enable", true);
+        config->DungeonScaleDownXP = sConfigMgr->GetBoolDefault("AutoBalance.DungeonScaleDownXP", false);
+
+        if (!StatsCache.Init(std::max(sConfigMgr->GetIntDefault("AutoBalance.StatsCache.Size", 4096), 0)))
+            sLog->outError("AutoBalance.StatsCache.Size only takes effect after a restart.");
+        config->PrecomputeEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Precompute", true);
+
+        config->AsyncRescaleThreads = std::max(sConfigMgr->GetIntDefault("AutoBalance.AsyncRescale.Threads", 2), 0);
+        if (!RescaleWorkers.Start(config->AsyncRescaleThreads))
+            sLog->outError("AutoBalance.AsyncRescale.Threads only takes effect after a restart, set it to 0 to rescale on the map threads.");
+
+        config->ImmunitiesEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Enable", false);
+        config->ImmunitiesPetEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Pet.Enable", false);
+        config->ImmunitiesMaxPlayers = sConfigMgr->GetIntDefault("AutoBalance.Immunities.MaxPlayers", 3);
+        config->ImmunitiesCharmEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Charm.Enable", true);
+        config->ImmunitiesFearEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Fear.Enable", true);
+        config->ImmunitiesSilenceEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Silence.Enable", true);
+        config->ImmunitiesSleepEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Sleep.Enable", true);
+        config->ImmunitiesStunEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Stun.Enable", true);
+        config->ImmunitiesFreezeEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Freeze.Enable", true);
+        config->ImmunitiesKnockoutEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Knockout.Enable", true);
+        config->ImmunitiesPolymorphEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Polymorph.Enable", true);
+        config->ImmunitiesHorrorEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Horror.Enable", true);
+        config->ImmunitiesDazeEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Daze.Enable", true);
+        config->ImmunitiesSappedEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.Sapped.Enable", true);
+        config->ImmunitiesKnockBackEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.KnockBack.Enable", true);
+        config->ImmunitiesPowerDrainEnabled = sConfigMgr->GetBoolDefault("AutoBalance.Immunities.PowerDrain.Enable", true);
+
+        config->LevelScaling = sConfigMgr->GetIntDefault("AutoBalance.levelScaling", 1);
+        config->PlayerCountDifficultyOffset = sConfigMgr->GetIntDefault("AutoBalance.playerCountDifficultyOffset", 0);
+        config->higherOffset = sConfigMgr->GetIntDefault("AutoBalance.levelHigherOffset", 3);
+        config->lowerOffset = sConfigMgr->GetIntDefault("AutoBalance.levelLowerOffset", 0);
+        config->rewardRaid = sConfigMgr->GetIntDefault("AutoBalance.reward.raidToken", 49426);
+        config->rewardDungeon = sConfigMgr->GetIntDefault("AutoBalance.reward.dungeonToken", 47241);
+        config->MinPlayerReward = sConfigMgr->GetFloatDefault("AutoBalance.reward.MinPlayerReward", 1);
+
+        float* inflectionPoints = config->inflection.points;
+        inflectionPoints[AB_INFLECTION_DUNGEON] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPoint", 0.5f);
+        inflectionPoints[AB_INFLECTION_RAID] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid", inflectionPoints[AB_INFLECTION_DUNGEON]);
+        inflectionPoints[AB_INFLECTION_RAID25] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid25M", inflectionPoints[AB_INFLECTION_RAID]);
+        inflectionPoints[AB_INFLECTION_RAID10] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid10M", inflectionPoints[AB_INFLECTION_RAID]);
+        inflectionPoints[AB_INFLECTION_DUNGEON_HEROIC] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointHeroic", inflectionPoints[AB_INFLECTION_DUNGEON]);
+        inflectionPoints[AB_INFLECTION_RAID_HEROIC] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaidHeroic", inflectionPoints[AB_INFLECTION_RAID]);
+        inflectionPoints[AB_INFLECTION_RAID25_HEROIC] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid25MHeroic", inflectionPoints[AB_INFLECTION_RAID25]);
+        inflectionPoints[AB_INFLECTION_RAID10_HEROIC] = sConfigMgr->GetFloatDefault("AutoBalance.InflectionPointRaid10MHeroic", inflectionPoints[AB_INFLECTION_RAID10]);
+        config->inflection.bossMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.BossInflectionMult", 1.0f);
+        config->curve.Build(ABScalingCurveType(sConfigMgr->GetIntDefault("AutoBalance.ScalingCurve", AB_CURVE_TANH)),
+            sConfigMgr->GetStringDefault("AutoBalance.ScalingCurve.Points", ""), config->inflection);
+        config->scaling.globalRate = sConfigMgr->GetFloatDefault("AutoBalance.rate.global", 1.0f);
+        config->scaling.healthMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.health", 1.0f);
+        config->scaling.manaMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.mana", 1.0f);
+        config->scaling.armorMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.armor", 1.0f);
+        config->scaling.damageMultiplier = sConfigMgr->GetFloatDefault("AutoBalance.rate.damage", 1.0f);
+        config->scaling.minHealthModifier = sConfigMgr->GetFloatDefault("AutoBalance.MinHPModifier", 0.1f);
+        config->scaling.minManaModifier = sConfigMgr->GetFloatDefault("AutoBalance.MinManaModifier", 0.1f);
+        config->scaling.minDamageModifier = sConfigMgr->GetFloatDefault("AutoBalance.MinDamageModifier", 0.1f);
+        config->scaling.levelScaling = config->LevelScaling != 0;
+        SelectStatsKernels(config->scaling, config->statsKernels);
+
+        PublishConfig(std::move(config));
+        // classified again with the new DungeonsOnly
+        ResetMapScaling();
+
+        for (std::string const& failure : RunScalingSelfTest(0.0f))
+            sLog->outError("AutoBalance: scaling kernel does not match its golden values, %s", failure.c_str());
     }
+
+private:
+    // time since the last AutoBalance.Perf.DumpFile write
+    uint32 _perfDumpTimer = 0;
 };
 
 class AutoBalance_PlayerScript : public PlayerScript
@@ -274,53 +4007,49 @@ class AutoBalance_PlayerScript : public PlayerScript
         {
         }
 
-        void OnBeforeUpdate(Player *player, uint32 /*p_time*/) override
+        bool OnBeforeTeleport(Player* player, uint32 mapid, float /*x*/, float /*y*/, float /*z*/, float /*orientation*/, uint32 /*options*/, Unit* /*target*/) override
         {
-            if (!ImmunitiesEnabled)
-                return;
-
-            Map* map = player->GetMap();
-
-            if (map->IsDungeon() && map->GetPlayersCountExceptGMs() <= ImmunitiesMaxPlayers)
-            {
-                if (ImmunitiesCharmEnabled && player->HasAuraType(SPELL_AURA_MOD_CHARM))
-                    if (Unit* charmer = player->GetCharmerOrOwner())
-                    {
-                        player->RemoveAurasByType(SPELL_AURA_MOD_CHARM);
-                        charmer->SetInCombatWith(player);
-                        charmer->AddThreat(player, 1); // add threat to prevent the charmer from evading
-                    }
+            ABConfig const& config = GetConfig();
+            if (!config.enabled || !config.PrecomputeEnabled || !StatsCache.IsEnabled() || mapid == player->GetMapId())
+                return true;
 
-                if (ImmunitiesSilenceEnabled && player->HasAuraType(SPELL_AURA_MOD_SILENCE))
-                    player->RemoveAurasByType(SPELL_AURA_MOD_SILENCE);
+            MapEntry const* mapEntry = sMapStore.LookupEntry(mapid);
+            if (!mapEntry || !mapEntry->IsDungeon())
+                return true;
 
-                if (ImmunitiesFearEnabled)
-                {
-                    if (player->HasAuraType(SPELL_AURA_MOD_FEAR))
-                        player->RemoveAurasByType(SPELL_AURA_MOD_FEAR);
+            ABExpectedGroup group;
+            group.players = 1;
+            group.level = player->getLevel();
+            group.time = getMSTime();
 
-                    if (ImmunitiesPetEnabled)
-                        if (Pet* pet = player->GetPet())
-                            if (pet->HasAuraType(SPELL_AURA_MOD_FEAR))
-                                pet->RemoveAurasByType(SPELL_AURA_MOD_FEAR);
-                }
+            if (Group* playerGroup = player->GetGroup())
+            {
+                group.players = std::max<uint32>(playerGroup->GetMembersCount(), 1);
+                for (GroupReference* itr = playerGroup->GetFirstMember(); itr != nullptr; itr = itr->next())
+                    if (Player* member = itr->GetSource())
+                        group.level = std::max(group.level, member->getLevel());
             }
+
+            std::lock_guard<std::mutex> guard(ExpectedGroupsLock);
+            ExpectedGroups[mapid] = group;
+            return true;
         }
 
         void OnAfterGuardianInitStatsForLevel(Player* player, Guardian* guardian) override
         {
-            if (!ImmunitiesEnabled || !ImmunitiesPetEnabled)
+            ABConfig const& config = GetConfig();
+            if (!config.ImmunitiesEnabled || !config.ImmunitiesPetEnabled)
                 return;
 
             if (Pet* pet = guardian->ToPet())
             {
                 Map* map = pet->GetMap();
 
-                if (map->IsDungeon() && map->GetPlayersCountExceptGMs() <= ImmunitiesMaxPlayers)
+                if (AreImmunitiesActive(GetMapInfo(map)))
                 {
                     ApplyImmunity(pet->ToUnit(), true);
 
-                    if (PlayerChangeNotify)
+                    if (config.PlayerChangeNotify)
                     {
                         ChatHandler chatHandle = ChatHandler(player->GetSession());
                         chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 Pet immunities applied |r");
@@ -330,7 +4059,7 @@ class AutoBalance_PlayerScript : public PlayerScript
                 {
                     ApplyImmunity(pet->ToUnit(), false);
 
-                    if (PlayerChangeNotify && map->IsDungeon())
+                    if (config.PlayerChangeNotify && map->IsDungeon())
                     {
                         ChatHandler chatHandle = ChatHandler(player->GetSession());
                         chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 Pet immunities removed |r");
@@ -348,29 +4077,52 @@ class AutoBalance_PlayerScript : public PlayerScript
 
         void OnLevelChanged(Player* player, uint8 /*oldlevel*/) override
         {
-            if (!enabled || !player)
+            ABConfig const& config = GetConfig();
+            if (!player || !player->IsInWorld())
+                return;
+
+            AutoBalanceMapInfo *mapABInfo=GetMapInfo(player->GetMap());
+            ABRoster* roster = GetRoster(player->GetMap(), mapABInfo);
+            if (!roster)
+                return;
+
+            roster->Update(player);
+
+            if (!config.enabled)
                 return;
 
-            if (LevelScaling == 0)
+            if (config.LevelScaling == 0)
                 return;
 
-            AutoBalanceMapInfo *mapABInfo=player->GetMap()->CustomData.GetDefault<AutoBalanceMapInfo>("AutoBalanceMapInfo");
+            mapABInfo->SetMapLevel(roster->GetMaxLevel());
+        }
+
+        void OnPlayerEnterCombat(Player* player, Unit* /*enemy*/) override
+        {
+            if (player->IsInWorld())
+                if (ABRoster* roster = GetRoster(player->GetMap(), GetMapInfo(player->GetMap())))
+                    roster->SetInCombat(player, true);
+        }
 
-            if (mapABInfo->mapLevel < player->getLevel())
-                mapABInfo->mapLevel = player->getLevel();
+        void OnPlayerLeaveCombat(Player* player) override
+        {
+            if (player->IsInWorld())
+                if (ABRoster* roster = GetRoster(player->GetMap(), GetMapInfo(player->GetMap())))
+                    roster->SetInCombat(player, false);
         }
 
         void OnGiveXP(Player* player, uint32& amount, Unit* victim) override
         {
-            if (victim && DungeonScaleDownXP)
+            ABConfig const& config = GetConfig();
+            if (victim && config.DungeonScaleDownXP)
             {
                 Map* map = player->GetMap();
 
                 if (map->IsDungeon())
                 {
                     // Ensure that the players always get the same XP, even when entering the dungeon alone
-                    uint32 maxPlayerCount = ((InstanceMap*)sMapMgr->FindMap(map->GetId(), map->GetInstanceId()))->GetMaxPlayers();
-                    uint32 currentPlayerCount = map->GetPlayersCountExceptGMs();
+                    uint32 maxPlayerCount = GetMapInfo(map)->context.maxPlayers;
+                    uint32 currentPlayerCount = GetMapInfo(map)->roster.GetPlayerCount();
                     amount *= (float)currentPlayerCount / maxPlayerCount;
                 }
             }
@@ -409,30 +4161,70 @@ class AutoBalance_UnitScript : public UnitScript
         damage = _Modifer_DealDamage(target, attacker, damage);
     }
 
+    // The immunities are enforced when one of the relevant auras is applied instead of
+    // scanning the auras of every player on every update. The removal itself is deferred
+    // to the next map update, the aura is still being applied here.
+    void OnAuraApply(Unit* unit, Aura* aura) override
+    {
+        ABConfig const& config = GetConfig();
+        if (!config.ImmunitiesEnabled || !unit || !aura)
+            return;
+
+        Player* player = nullptr;
+
+        if (unit->GetTypeId() == TYPEID_PLAYER)
+        {
+            if ((config.ImmunitiesCharmEnabled && aura->HasEffectType(SPELL_AURA_MOD_CHARM))
+                || (config.ImmunitiesSilenceEnabled && aura->HasEffectType(SPELL_AURA_MOD_SILENCE))
+                || (config.ImmunitiesFearEnabled && aura->HasEffectType(SPELL_AURA_MOD_FEAR)))
+                player = unit->ToPlayer();
+        }
+        else if (config.ImmunitiesPetEnabled && config.ImmunitiesFearEnabled && unit->IsPet() && aura->HasEffectType(SPELL_AURA_MOD_FEAR))
+            player = unit->GetCharmerOrOwnerPlayerOrPlayerItself();
+
+        if (!player || !player->IsInWorld())
+            return;
+
+        AutoBalanceMapInfo* mapABInfo = GetMapInfo(player->GetMap());
+
+        if (AreImmunitiesActive(mapABInfo))
+            QueueImmunityCheck(mapABInfo, player);
+    }
+
 
-    uint32 _Modifer_DealDamage(Unit* target, Unit* attacker, uint32 damage)
+    uint32 _Modifer_DealDamage(Unit* /*target*/, Unit* attacker, uint32 damage)
     {
-        if (!enabled)
+        ABConfig const& config = GetConfig();
+        if (!config.enabled)
             return damage;
 
         if (!attacker || attacker->GetTypeId() == TYPEID_PLAYER || !attacker->IsInWorld())
             return damage;
 
-        float damageMultiplier = attacker->CustomData.GetDefault<AutoBalanceCreatureInfo>("AutoBalanceCreatureInfo")->DamageMultiplier;
-
-        if (damageMultiplier == 1)
+        // no creature of this map is scaled, one load
+        if (!IsScaledMap(attacker->GetMap()))
             return damage;
 
-        if (!(!DungeonsOnly
-                || (target->GetMap()->IsDungeon() && attacker->GetMap()->IsDungeon()) || (attacker->GetMap()->IsBattleground()
-                     && target->GetMap()->IsBattleground())))
+        // creatures that have never been scaled have no entry and none is created here
+        AutoBalanceMapInfo const* mapABInfo = MapInfoKey.Find(attacker->GetMap()->CustomData);
+        if (!mapABInfo)
             return damage;
 
+        if (config.PerfEnabled)
+            CountPerf(&mapABInfo->perf, AB_PERF_DAMAGE_CALLS);
+
+        AutoBalanceCreatureInfo const* creatureABInfo = mapABInfo->creatures.Find(attacker->GetGUID());
+
+        if (!creatureABInfo || !ScalesDamage(mapABInfo, creatureABInfo))
+            return damage;
 
         if ((attacker->IsHunterPet() || attacker->IsPet() || attacker->IsSummon() || attacker->IsVehicle()) && attacker->IsControlledByPlayer())
             return damage;
 
-        return damage * damageMultiplier;
+        if (config.PerfEnabled)
+            CountPerf(&mapABInfo->perf, AB_PERF_DAMAGE_MODIFIED);
+
+        return damage * creatureABInfo->DamageMultiplier;
     }
 };
 
@@ -445,9 +4237,141 @@ class AutoBalance_AllMapScript : public AllMapScript
         {
         }
 
+        void OnCreateMap(Map* map) override
+        {
+            AutoBalanceMapInfo* mapABInfo = GetMapInfo(map);
+
+            ABConfig const& config = GetConfig();
+            if (!config.enabled || !config.PrecomputeEnabled || !StatsCache.IsEnabled() || !map->IsDungeon() || !map->GetInstanceId())
+                return;
+
+            ABPrecomputeJob job;
+            {
+                std::lock_guard<std::mutex> guard(ExpectedGroupsLock);
+                auto itr = ExpectedGroups.find(map->GetId());
+                if (itr == ExpectedGroups.end())
+                    return;
+
+                job.group = itr->second;
+                ExpectedGroups.erase(itr);
+            }
+
+            if (getMSTimeDiff(job.group.time, getMSTime()) > ExpectedGroupTimeout)
+                return;
+
+            // scripts can change the count and the multiplier of each creature, and without
+            // a dungeon level range the area levels of the spawns are not known in advance
+            if (sABScriptMgr->HasScripts(AB_HOOK_BEFORE_MODIFY_ATTRIBUTES) || sABScriptMgr->HasScripts(AB_HOOK_AFTER_DEFAULT_MULTIPLIER)
+                || !mapABInfo->context.lfgMinLevel || !mapABInfo->context.lfgMaxLevel)
+                return;
+
+            job.mapId = map->GetId();
+            job.difficulty = uint8(map->GetDifficulty());
+            job.context = mapABInfo->context;
+            PrecomputeWorker.Queue(job);
+        }
+
+        void OnMapUpdate(Map* map, uint32 /*diff*/) override
+        {
+            // nothing queued on any map, the common case
+            if (!PendingImmunityChecks.load(std::memory_order_relaxed) && !PendingNotifications.load(std::memory_order_relaxed)
+                && !PendingRescales.load(std::memory_order_relaxed) && !ActiveRescaleWaves.load(std::memory_order_relaxed)
+                && !PendingImmunityReloads.load(std::memory_order_relaxed) && !PendingAsyncResults.load(std::memory_order_relaxed))
+                return;
+
+            AutoBalanceMapInfo* mapABInfo = GetMapInfo(map);
+
+            if (mapABInfo->asyncResults)
+                ApplyAsyncRescales(map, mapABInfo);
+
+            if (mapABInfo->immunityGeneration && mapABInfo->immunityGeneration != GetConfig().immunityGeneration)
+                ReloadImmunities(map, mapABInfo);
+
+            if (mapABInfo->rescaleBudget.IsInWave() && mapABInfo->rescaleBudget.EndUpdate(getMSTime()))
+                ActiveRescaleWaves.fetch_sub(1, std::memory_order_relaxed);
+
+            if (mapABInfo->rescalePending && !mapABInfo->roster.GetInCombatCount())
+                ApplyPendingRescale(map, mapABInfo);
+
+            if (mapABInfo->notifier.IsPending())
+                FlushNotifications(map, mapABInfo);
+
+            if (mapABInfo->pendingImmunityChecks.empty())
+                return;
+
+            std::vector<Player*> players;
+            players.swap(mapABInfo->pendingImmunityChecks);
+            PendingImmunityChecks.fetch_sub(players.size(), std::memory_order_relaxed);
+
+            // the player count may have changed since the checks were queued
+            if (!AreImmunitiesActive(mapABInfo))
+                return;
+
+            for (Player* player : players)
+                EnforceImmunities(player);
+        }
+
+        // a config reload changed the immunity settings, replaces the immunities of the players
+        // already in the dungeon without touching its creatures
+        void ReloadImmunities(Map* map, AutoBalanceMapInfo* mapABInfo)
+        {
+            ABConfig const& config = GetConfig();
+            mapABInfo->immunityGeneration = config.immunityGeneration;
+            CompleteImmunityReload();
+            ReloadStats.immunityMaps.fetch_add(1, std::memory_order_relaxed);
+
+            bool active = AreImmunitiesActive(mapABInfo);
+
+            Map::PlayerList const& playerList = map->GetPlayers();
+            for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
+                if (Player* playerHandle = playerIteration->GetSource())
+                {
+                    Pet* pet = playerHandle->GetPet();
+
+                    RemoveAllImmunities(playerHandle->ToUnit());
+                    if (pet)
+                        RemoveAllImmunities(pet->ToUnit());
+
+                    if (!active)
+                        continue;
+
+                    ApplyImmunity(playerHandle->ToUnit(), true);
+                    QueueImmunityCheck(mapABInfo, playerHandle);
+
+                    if (pet && config.ImmunitiesPetEnabled)
+                        ApplyImmunity(pet->ToUnit(), true);
+                }
+        }
+
+        // applies the latest roster state once the combat a player left during has ended,
+        // all changes made during that fight end up in this one rescale
+        void ApplyPendingRescale(Map* map, AutoBalanceMapInfo* mapABInfo)
+        {
+            ABConfig const& config = GetConfig();
+            ABTraceScope traceScope(AB_TRACE_ROSTER, map, mapABInfo->roster.GetPlayerCount());
+            SetRescalePending(mapABInfo, false);
+
+            if (!config.enabled)
+                return;
+
+            mapABInfo->SetPlayerCount(mapABInfo->roster.GetPlayerCount());
+            mapABInfo->SetMapLevel(mapABInfo->roster.GetMaxLevel());
+            AB_LOG_INFO("AutoBalance: map %u instance %u scaled for %u players at level %u after the combat.", map->GetId(), map->GetInstanceId(),
+                mapABInfo->playerCount, uint32(mapABInfo->mapLevel));
+
+            if (!mapABInfo->playerCount)
+                return;
+
+            if (config.PlayerChangeNotify)
+                NotifyMap(mapABInfo, "Combat ended in the Instance %s. Auto setting player count to %u (Player Difficulty Offset = %u)", map->GetMapName(), mapABInfo->playerCount, config.PlayerCountDifficultyOffset);
+
+            ApplyImmunities(map, mapABInfo, nullptr, false);
+        }
+
         void ApplyImmunities(Map* map, AutoBalanceMapInfo* mapABInfo, Player* player, bool mapEnter)
         {
-            if (!ImmunitiesEnabled)
+            ABConfig const& config = GetConfig();
+            if (!config.ImmunitiesEnabled)
                 return;
 
             Map::PlayerList const& playerList = map->GetPlayers();
@@ -456,13 +4380,15 @@ class AutoBalance_AllMapScript : public AllMapScript
             {
                 if (map->IsDungeon())
                 {
-                    if (mapABInfo->playerCount <= ImmunitiesMaxPlayers)
+                    if (mapABInfo->playerCount <= config.ImmunitiesMaxPlayers)
                     {
                         if (player)
                         {
                             ApplyImmunity(player->ToUnit(), true);
+                            // the player may already be affected by one of the auras
+                            QueueImmunityCheck(mapABInfo, player);
 
-                            if (PlayerChangeNotify)
+                            if (config.PlayerChangeNotify)
                             {
                                 ChatHandler chatHandle = ChatHandler(player->GetSession());
                                 chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 Player immunities applied |r");
@@ -470,176 +4396,141 @@ class AutoBalance_AllMapScript : public AllMapScript
                         }
                     }
                     else if (!playerList.isEmpty())
+                    {
+                        bool petsChanged = false;
                         for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
                             if (Player* playerHandle = playerIteration->GetSource())
                             {
                                 ApplyImmunity(playerHandle->ToUnit(), false);
 
-                                if (PlayerChangeNotify)
-                                {
-                                    ChatHandler chatHandle = ChatHandler(playerHandle->GetSession());
-                                    chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 Player immunities removed |r");
-                                }
-
-                                if (ImmunitiesPetEnabled)
+                                if (config.ImmunitiesPetEnabled)
                                     if (Pet* pet = playerHandle->GetPet())
                                     {
                                         ApplyImmunity(pet->ToUnit(), false);
-
-                                        if (PlayerChangeNotify)
-                                        {
-                                            ChatHandler chatHandle = ChatHandler(playerHandle->GetSession());
-                                            chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 Pet immunities removed |r");
-                                        }
+                                        petsChanged = true;
                                     }
                             }
+
+                        if (config.PlayerChangeNotify)
+                        {
+                            NotifyMap(mapABInfo, "Player immunities removed");
+                            if (petsChanged)
+                                NotifyMap(mapABInfo, "Pet immunities removed");
+                        }
+                    }
                 }
                 else if (player)
                 {
                     ApplyImmunity(player->ToUnit(), false);
                 }
             }
-            else if (map->IsDungeon() && mapABInfo->playerCount <= ImmunitiesMaxPlayers && !playerList.isEmpty())
+            else if (map->IsDungeon() && mapABInfo->playerCount <= config.ImmunitiesMaxPlayers && !playerList.isEmpty())
+            {
+                bool playersChanged = false;
+                bool petsChanged = false;
                 for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
                     if (Player* playerHandle = playerIteration->GetSource())
                         if (!player || playerHandle->GetGUID() != player->GetGUID())
                         {
                             ApplyImmunity(playerHandle->ToUnit(), true);
+                            QueueImmunityCheck(mapABInfo, playerHandle);
+                            playersChanged = true;
 
-                            if (PlayerChangeNotify)
-                            {
-                                ChatHandler chatHandle = ChatHandler(playerHandle->GetSession());
-                                chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 Player immunities applied |r");
-                            }
-
-                            if (ImmunitiesPetEnabled)
+                            if (config.ImmunitiesPetEnabled)
                                 if (Pet* pet = playerHandle->GetPet())
                                 {
                                     ApplyImmunity(pet->ToUnit(), true);
-
-                                    if (PlayerChangeNotify)
-                                    {
-                                        ChatHandler chatHandle = ChatHandler(playerHandle->GetSession());
-                                        chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 Pet immunities applied |r");
-                                    }
+                                    petsChanged = true;
                                 }
                         }
+
+                // sent after the leaving player is gone, so only the remaining players get it
+                if (config.PlayerChangeNotify && playersChanged)
+                {
+                    NotifyMap(mapABInfo, "Player immunities applied");
+                    if (petsChanged)
+                        NotifyMap(mapABInfo, "Pet immunities applied");
+                }
+            }
         }
 
         void OnPlayerEnterAll(Map* map, Player* player)
         {
-            if (!enabled)
-                return;
+            ABConfig const& config = GetConfig();
+            AutoBalanceMapInfo *mapABInfo=GetMapInfo(map);
 
-            if (player->IsGameMaster())
+            // always track the player, even if not conf enabled
+            // because we can enable at runtime and we need this information
+            ABRoster* roster = GetRoster(map, mapABInfo);
+            if (!roster)
                 return;
 
-            AutoBalanceMapInfo *mapABInfo=map->CustomData.GetDefault<AutoBalanceMapInfo>("AutoBalanceMapInfo");
+            roster->Add(player);
+            ABTraceScope traceScope(AB_TRACE_ROSTER, map, mapABInfo->roster.GetPlayerCount());
 
-            // always check level, even if not conf enabled
-            // because we can enable at runtime and we need this information
-            if (player) {
-                if (player->getLevel() > mapABInfo->mapLevel)
-                    mapABInfo->mapLevel = player->getLevel();
-            } else {
-                Map::PlayerList const &playerList = map->GetPlayers();
-                if (!playerList.isEmpty())
-                {
-                    for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
-                    {
-                        if (Player* playerHandle = playerIteration->GetSource())
-                        {
-                            if (!playerHandle->IsGameMaster() && playerHandle->getLevel() > mapABInfo->mapLevel)
-                                mapABInfo->mapLevel = playerHandle->getLevel();
-                        }
-                    }
-                }
-            }
+            if (!config.enabled)
+                return;
 
-            mapABInfo->playerCount = map->GetPlayersCountExceptGMs();
+            if (player->IsGameMaster())
+                return;
 
-            if (PlayerChangeNotify)
-            {
-                if (map->GetEntry()->IsDungeon() && player)
-                {
-                    Map::PlayerList const &playerList = map->GetPlayers();
-                    if (!playerList.isEmpty())
-                    {
-                        for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
-                        {
-                            if (Player* playerHandle = playerIteration->GetSource())
-                            {
-                                ChatHandler chatHandle = ChatHandler(playerHandle->GetSession());
-                                chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 %s entered the Instance %s. Auto setting player count to %u (Player Difficulty Offset = %u) |r", player->GetName().c_str(), map->GetMapName(), mapABInfo->playerCount + PlayerCountDifficultyOffset, PlayerCountDifficultyOffset);
-                            }
-                        }
-                    }
-                }
-            }
+            mapABInfo->SetMapLevel(mapABInfo->roster.GetMaxLevel());
+            mapABInfo->SetPlayerCount(mapABInfo->roster.GetPlayerCount());
+            // the count is up to date again, nothing left to apply after the combat
+            SetRescalePending(mapABInfo, false);
+            AB_LOG_INFO("AutoBalance: player entered map %u instance %u, scaled for %u players at level %u.", map->GetId(), map->GetInstanceId(),
+                mapABInfo->playerCount, uint32(mapABInfo->mapLevel));
+
+            if (config.PlayerChangeNotify && map->GetEntry()->IsDungeon())
+                NotifyMap(mapABInfo, "%s entered the Instance %s. Auto setting player count to %u (Player Difficulty Offset = %u)", player->GetName().c_str(), map->GetMapName(), mapABInfo->playerCount + config.PlayerCountDifficultyOffset, config.PlayerCountDifficultyOffset);
 
             ApplyImmunities(map, mapABInfo, player, true);
         }
 
         void OnPlayerLeaveAll(Map* map, Player* player)
         {
-            if (!enabled)
+            ABConfig const& config = GetConfig();
+            AutoBalanceMapInfo *mapABInfo=GetMapInfo(map);
+
+            // never keep a queued check for a player that is no longer on the map
+            DequeueImmunityCheck(mapABInfo, player);
+
+            ABRoster* roster = GetRoster(map, mapABInfo);
+            if (!roster)
                 return;
 
-            if (player->IsGameMaster())
+            roster->Remove(player);
+            ABTraceScope traceScope(AB_TRACE_ROSTER, map, mapABInfo->roster.GetPlayerCount());
+
+            if (!config.enabled)
                 return;
 
-            AutoBalanceMapInfo *mapABInfo=map->CustomData.GetDefault<AutoBalanceMapInfo>("AutoBalanceMapInfo");
+            if (player->IsGameMaster())
+                return;
 
-            if (map->GetEntry() && map->GetEntry()->IsDungeon())
+            // don't rescale the creatures the remaining players are fighting, OnMapUpdate
+            // applies the latest count once the combat is over
+            if (map->GetEntry() && map->GetEntry()->IsDungeon() && mapABInfo->roster.GetInCombatCount())
             {
-                bool keepPlayerCount = false;
-                Map::PlayerList const& pl = map->GetPlayers();
-                for (Map::PlayerList::const_iterator itr = pl.begin(); itr != pl.end(); ++itr)
-                    if (Player* plr = itr->GetSource())
-                        if (plr->IsInCombat())
-                        {
-                            keepPlayerCount = true;
-                            break;
-                        }
+                SetRescalePending(mapABInfo, true);
 
-                if (keepPlayerCount)
-                {
-                    for (Map::PlayerList::const_iterator itr = pl.begin(); itr != pl.end(); ++itr)
-                        if (Player* plr = itr->GetSource())
-                        {
-                            ChatHandler chat = ChatHandler(plr->GetSession());
-                            chat.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 %s left the instance %s during combat, re-enter the instance to fix the scaling |r", player->GetName().c_str(), map->GetMapName());
-                        }
-                }
-                else
-                    mapABInfo->playerCount = map->GetPlayersCountExceptGMs() - 1;
-            }
+                if (config.PlayerChangeNotify)
+                    NotifyMap(mapABInfo, "%s left the instance %s during combat, the scaling will be updated once the combat is over", player->GetName().c_str(), map->GetMapName());
 
-            // always check level, even if not conf enabled
-            // because we can enable at runtime and we need this information
-            if (!mapABInfo->playerCount) {
-                mapABInfo->mapLevel = 0;
                 return;
             }
 
-            if (PlayerChangeNotify)
-            {
-                if (map->GetEntry()->IsDungeon() && player)
-                {
-                    Map::PlayerList const &playerList = map->GetPlayers();
-                    if (!playerList.isEmpty())
-                    {
-                        for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
-                        {
-                            if (Player* playerHandle = playerIteration->GetSource())
-                            {
-                                ChatHandler chatHandle = ChatHandler(playerHandle->GetSession());
-                                chatHandle.PSendSysMessage("|cffFF0000 [AutoBalance]|r|cffFF8000 %s left the Instance %s. Auto setting player count to %u (Player Difficulty Offset = %u) |r", player->GetName().c_str(), map->GetMapName(), mapABInfo->playerCount, PlayerCountDifficultyOffset);
-                            }
-                        }
-                    }
-                }
-            }
+            SetRescalePending(mapABInfo, false);
+            mapABInfo->SetPlayerCount(mapABInfo->roster.GetPlayerCount());
+            mapABInfo->SetMapLevel(mapABInfo->roster.GetMaxLevel());
+            AB_LOG_INFO("AutoBalance: player left map %u instance %u, scaled for %u players at level %u.", map->GetId(), map->GetInstanceId(),
+                mapABInfo->playerCount, uint32(mapABInfo->mapLevel));
+
+            if (!mapABInfo->playerCount)
+                return;
+
+            if (config.PlayerChangeNotify && map->GetEntry()->IsDungeon())
+                NotifyMap(mapABInfo, "%s left the Instance %s. Auto setting player count to %u (Player Difficulty Offset = %u)", player->GetName().c_str(), map->GetMapName(), mapABInfo->playerCount, config.PlayerCountDifficultyOffset);
 
             ApplyImmunities(map, mapABInfo, player, false);
         }
@@ -656,7 +4547,8 @@ public:
 
     void Creature_SelectLevel(const CreatureTemplate* /*creatureTemplate*/, Creature* creature) override
     {
-        if (!enabled)
+        ABConfig const& config = GetConfig();
+        if (!config.enabled)
             return;
 
         ModifyCreatureAttributes(creature, true);
@@ -664,22 +4556,38 @@ public:
 
     void OnAllCreatureUpdate(Creature* creature, uint32 /*diff*/) override
     {
-        if (!enabled)
+        ABConfig const& config = GetConfig();
+        if (!config.enabled)
+            return;
+
+        if (config.HookStatsEnabled)
+            HookStats.updates.fetch_add(1, std::memory_order_relaxed);
+
+        // with DungeonsOnly this is where all the open world creatures end
+        if (!IsScaledMap(creature->GetMap()))
+        {
+            if (config.HookStatsEnabled)
+                HookStats.unscaledMap.fetch_add(1, std::memory_order_relaxed);
+
             return;
+        }
 
         ModifyCreatureAttributes(creature);
     }
 
     bool checkLevelOffset(uint8 selectedLevel, uint8 targetLevel) {
-        return selectedLevel && ((targetLevel >= selectedLevel && targetLevel <= (selectedLevel + higherOffset) ) || (targetLevel <= selectedLevel && targetLevel >= (selectedLevel - lowerOffset)));
+        return IsWithinLevelOffset(GetConfig(), selectedLevel, targetLevel);
     }
 
     void ModifyCreatureAttributes(Creature* creature, bool resetSelLevel = false)
     {
+        ABConfig const& config = GetConfig();
         if (!creature || !creature->GetMap())
             return;
 
-        if (!creature->GetMap()->IsDungeon() && !creature->GetMap()->IsBattleground() && DungeonsOnly)
+        Map* map = creature->GetMap();
+
+        if (!IsScaledMap(map))
             return;
 
         if (((creature->IsHunterPet() || creature->IsPet() || creature->IsSummon()) && creature->IsControlledByPlayer()))
@@ -687,57 +4595,118 @@ public:
             return;
         }
 
-        AutoBalanceMapInfo *mapABInfo=creature->GetMap()->CustomData.GetDefault<AutoBalanceMapInfo>("AutoBalanceMapInfo");
+        AutoBalanceMapInfo *mapABInfo=GetMapInfo(map);
+        if (config.PerfEnabled)
+            CountPerf(&mapABInfo->perf, AB_PERF_MODIFY_CALLS);
+
+        // creatures only get an entry once they are scaled or found to be in DisabledID
+        AutoBalanceCreatureInfo *creatureABInfo=mapABInfo->creatures.Find(creature->GetGUID());
+
+        // spawn, respawn and UpdateEntry all go through Creature::SelectLevel, which
+        // calls us with resetSelLevel: drop the cached state to force a recalculation
+        if (resetSelLevel && creatureABInfo) {
+            creatureABInfo->selectedLevel = 0;
+            creatureABInfo->generation = 0;
+            creatureABInfo->scaled = false;
+            // SelectLevel has set the template stats again
+            creatureABInfo->applied = false;
+            creatureABInfo->asyncPending = false;
+        }
+
         if (!mapABInfo->mapLevel)
             return;
 
+        uint32 generation = GetScalingGeneration(mapABInfo);
+
+        // nothing the scaling depends on has changed since the last evaluation
+        if (creatureABInfo && creatureABInfo->generation == generation)
+        {
+            if (config.HookStatsEnabled && !resetSelLevel)
+                HookStats.upToDate.fetch_add(1, std::memory_order_relaxed);
+
+            return;
+        }
+
+        if (!creature->IsAlive())
+            return;
+
         CreatureTemplate const *creatureTemplate = creature->GetCreatureTemplate();
 
-        InstanceMap* instanceMap = ((InstanceMap*)sMapMgr->FindMap(creature->GetMapId(), creature->GetInstanceId()));
-        uint32 maxNumberOfPlayers = instanceMap->GetMaxPlayers();
-        int forcedNumPlayers = GetForcedNumPlayers(creatureTemplate->Entry);
+        ABMapContext& mapContext = mapABInfo->context;
+        uint32 maxNumberOfPlayers = mapContext.maxPlayers;
+        ABCreatureOverride const* creatureOverride = config.creatureOverrides.Find(creatureTemplate->Entry);
+        int32 forcedNumPlayers = creatureOverride ? creatureOverride->forcedPlayerCount : -1;
+
+        // a config reload changed a setting the scaling of this creature depends on
+        ABConfigStamp configStamp = config.GetStamp(mapContext.inflectionBucket, creatureOverride);
+        bool configChanged = !creatureABInfo || creatureABInfo->configStamp != configStamp;
 
         if (forcedNumPlayers > 0)
             maxNumberOfPlayers = forcedNumPlayers; // Force maxNumberOfPlayers to be changed to match the Configuration entries ForcedID2, ForcedID5, ForcedID10, ForcedID20, ForcedID25, ForcedID40
         else if (forcedNumPlayers == 0)
-            return; // forcedNumPlayers 0 means that the creature is contained in DisabledID -> no scaling
-
-        AutoBalanceCreatureInfo *creatureABInfo=creature->CustomData.GetDefault<AutoBalanceCreatureInfo>("AutoBalanceCreatureInfo");
+        {
+            // kept as evaluated but not scaled, so its next updates stop at the generation compare
+            if (!creatureABInfo)
+                creatureABInfo = mapABInfo->creatures.Create(creature->GetGUID(), map);
 
-        // force resetting selected level.
-        // this is also a "workaround" to fix bug of not recalculated
-        // attributes when UpdateEntry has been used.
-        // TODO: It's better and faster to implement a core hook
-        // in that position and force a recalculation then
-        if ((creatureABInfo->entry != 0 && creatureABInfo->entry != creature->GetEntry()) || resetSelLevel) {
-            creatureABInfo->selectedLevel = 0; // force a recalculation
+            creatureABInfo->generation = generation;
+            creatureABInfo->configStamp = configStamp;
+            return; // forcedNumPlayers 0 means that the creature is contained in DisabledID -> no scaling
         }
 
-        if (!creature->IsAlive())
-            return;
-
-        uint32 curCount=mapABInfo->playerCount + PlayerCountDifficultyOffset;
+        uint32 curCount=mapABInfo->playerCount + config.PlayerCountDifficultyOffset;
 
         uint8 bonusLevel = creatureTemplate->rank == CREATURE_ELITE_WORLDBOSS ? 3 : 0;
-        // already scaled
-        if (creatureABInfo->selectedLevel > 0) {
-            if (LevelScaling) {
+        // already scaled, unless the stats of an earlier evaluation are still being computed
+        if (!configChanged && creatureABInfo->selectedLevel > 0 && !creatureABInfo->asyncPending) {
+            if (config.LevelScaling) {
                 if (checkLevelOffset(mapABInfo->mapLevel + bonusLevel, creature->getLevel()) &&
                     checkLevelOffset(creatureABInfo->selectedLevel, creature->getLevel()) &&
                     creatureABInfo->instancePlayerCount == curCount) {
+                    creatureABInfo->generation = generation;
                     return;
                 }
             } else if (creatureABInfo->instancePlayerCount == curCount) {
+                    creatureABInfo->generation = generation;
                     return;
             }
         }
 
-        creatureABInfo->instancePlayerCount = curCount;
+        if (!curCount) // no players in map, do not modify attributes
+        {
+            if (creatureABInfo)
+            {
+                creatureABInfo->instancePlayerCount = curCount;
+                creatureABInfo->generation = generation;
+            }
+            return;
+        }
 
-        if (!creatureABInfo->instancePlayerCount) // no players in map, do not modify attributes
+        // spreads a map wide rescale over several map updates, spawns are always scaled
+        // right away. A deferred creature keeps its old generation and retries next update
+        if (!resetSelLevel && !CanRescale(creature, mapABInfo))
             return;
 
-        if (!sABScriptMgr->OnBeforeModifyAttributes(creature, creatureABInfo->instancePlayerCount))
+        ABRescaleTimer rescaleTimer(mapABInfo);
+        ABTraceScope traceScope(AB_TRACE_RESCALE, map, creature->GetEntry());
+
+        // spawns have no stamp yet, only the rescales caused by a reload are counted
+        if (!creatureABInfo)
+            creatureABInfo = mapABInfo->creatures.Create(creature->GetGUID(), map);
+        else if (configChanged && creatureABInfo->selectedLevel > 0)
+            ReloadStats.rescaledCreatures.fetch_add(1, std::memory_order_relaxed);
+
+        creatureABInfo->instancePlayerCount = curCount;
+        creatureABInfo->generation = generation;
+        creatureABInfo->configStamp = configStamp;
+
+        ABScalingContext scalingContext;
+        scalingContext.creature = creature;
+        scalingContext.instancePlayerCount = creatureABInfo->instancePlayerCount;
+
+        bool scale = sABScriptMgr->OnScalingStart(scalingContext);
+        creatureABInfo->instancePlayerCount = scalingContext.instancePlayerCount;
+        if (!scale)
             return;
 
         uint8 originalLevel = creatureTemplate->maxlevel;
@@ -745,18 +4714,19 @@ public:
         uint8 level = mapABInfo->mapLevel;
 
         uint8 areaMinLvl, areaMaxLvl;
-        getAreaLevel(creature->GetMap(), creature->GetAreaId(), areaMinLvl, areaMaxLvl);
+        mapContext.GetAreaLevel(creature->GetAreaId(), areaMinLvl, areaMaxLvl);
 
         // avoid level changing for critters and special creatures (spell summons etc.) in instances
         bool skipLevel=false;
+        bool levelChanged = false;
         if (originalLevel <= 1 && areaMinLvl >= 5)
             skipLevel = true;
 
-        if (LevelScaling && creature->GetMap()->IsDungeon() && !skipLevel && !checkLevelOffset(level, originalLevel)) {  // change level only whithin the offsets and when in dungeon/raid
+        if (config.LevelScaling && mapContext.isDungeon && !skipLevel && !checkLevelOffset(level, originalLevel)) {  // change level only whithin the offsets and when in dungeon/raid
             if (level != creatureABInfo->selectedLevel || creatureABInfo->selectedLevel != creature->getLevel()) {
                 // keep bosses +3 level
                 creatureABInfo->selectedLevel = level + bonusLevel;
-                creature->SetLevel(creatureABInfo->selectedLevel);
+                levelChanged = true;
             }
         } else {
             creatureABInfo->selectedLevel = creature->getLevel();
@@ -765,202 +4735,175 @@ public:
         creatureABInfo->entry = creature->GetEntry();
 
         bool useDefStats = false;
-        if (LevelUseDb && creature->getLevel() >= creatureTemplate->minlevel && creature->getLevel() <= creatureTemplate->maxlevel)
+        if (config.LevelUseDb && creatureABInfo->selectedLevel >= creatureTemplate->minlevel && creatureABInfo->selectedLevel <= creatureTemplate->maxlevel)
             useDefStats = true;
 
-        CreatureBaseStats const* origCreatureStats = sObjectMgr->GetCreatureBaseStats(originalLevel, creatureTemplate->unit_class);
-        CreatureBaseStats const* creatureStats = sObjectMgr->GetCreatureBaseStats(creatureABInfo->selectedLevel, creatureTemplate->unit_class);
-
-        uint32 baseHealth = origCreatureStats->GenerateHealth(creatureTemplate);
-        uint32 baseMana = origCreatureStats->GenerateMana(creatureTemplate);
-        uint32 scaledHealth = 0;
-        uint32 scaledMana = 0;
-
-        // Note: InflectionPoint handle the number of players required to get 50% health.
-        //       you'd adjust this to raise or lower the hp modifier for per additional player in a non-whole group.
-        //
-        //       diff modify the rate of percentage increase between
-        //       number of players. Generally the closer to the value of 1 you have this
-        //       the less gradual the rate will be. For example in a 5 man it would take 3
-        //       total players to face a mob at full health.
-        //
-        //       The +1 and /2 values raise the TanH function to a positive range and make
-        //       sure the modifier never goes above the value or 1.0 or below 0.
-        //
         float defaultMultiplier = 1.0f;
         if (creatureABInfo->instancePlayerCount < maxNumberOfPlayers)
-        {
-            float inflectionValue  = (float)maxNumberOfPlayers;
-
-            if (instanceMap->IsHeroic())
-            {
-                if (instanceMap->IsRaid())
-                {
-                    switch (instanceMap->GetMaxPlayers())
-                    {
-                        case 10:
-                            inflectionValue *= InflectionPointRaid10MHeroic;
-                            break;
-                        case 25:
-                            inflectionValue *= InflectionPointRaid25MHeroic;
-                            break;
-                        default:
-                            inflectionValue *= InflectionPointRaidHeroic;
-                    }
-                }
-                else
-                    inflectionValue *= InflectionPointHeroic;
-            }
-            else
-            {
-                if (instanceMap->IsRaid())
-                {
-                    switch (instanceMap->GetMaxPlayers())
-                    {
-                        case 10:
-                            inflectionValue *= InflectionPointRaid10M;
-                            break;
-                        case 25:
-                            inflectionValue *= InflectionPointRaid25M;
-                            break;
-                        default:
-                            inflectionValue *= InflectionPointRaid;
-                    }
-                }
-                else
-                    inflectionValue *= InflectionPoint;
-            }
-            if (creature->IsDungeonBoss()) {
-                inflectionValue *= BossInflectionMult;
-            }
-
-            float diff = ((float)maxNumberOfPlayers/5)*1.5f;
-            defaultMultiplier = (tanh(((float)creatureABInfo->instancePlayerCount - inflectionValue) / diff) + 1.0f) / 2.0f;
-        }
+            defaultMultiplier = config.curve.Get(mapContext.inflectionBucket, creature->IsDungeonBoss(), maxNumberOfPlayers, creatureABInfo->instancePlayerCount);
 
-        if (!sABScriptMgr->OnAfterDefaultMultiplier(creature, defaultMultiplier))
+        scalingContext.defaultMultiplier = defaultMultiplier;
+        if (!sABScriptMgr->OnScalingMultiplier(scalingContext))
             return;
+        defaultMultiplier = scalingContext.defaultMultiplier;
 
-        creatureABInfo->HealthMultiplier =   healthMultiplier * defaultMultiplier * globalRate;
+        // the creatures of a pack, and of every instance of the same dungeon, share one result
+        ABStatsKey cacheKey = MakeStatsKey(config, creatureTemplate, creatureOverride, creatureABInfo->selectedLevel, level, areaMinLvl, areaMaxLvl,
+            mapContext.isRaid, skipLevel, useDefStats, defaultMultiplier);
 
-        if (creatureABInfo->HealthMultiplier <= MinHPModifier)
+        // the computation may run on a worker, the level is set by the apply stage with the stats
+        ABScaledStats stats;
+        if (!StatsCache.IsEnabled() || !StatsCache.Find(cacheKey, stats))
         {
-            creatureABInfo->HealthMultiplier = MinHPModifier;
-        }
-
-        float hpStatsRate  = 1.0f;
-        if (!useDefStats && LevelScaling && !skipLevel) {
-            float newBaseHealth = 0;
-            if (level <= 60)
-                newBaseHealth=creatureStats->BaseHealth[0];
-            else if(level <= 70)
-                newBaseHealth=creatureStats->BaseHealth[1];
-            else {
-                newBaseHealth=creatureStats->BaseHealth[2];
-                // special increasing for end-game contents
-                if (LevelEndGameBoost)
-                    newBaseHealth *= creatureABInfo->selectedLevel >= 75 && originalLevel < 75 ? float(creatureABInfo->selectedLevel-70) * 0.3f : 1;
-            }
-
-            float newHealth =  newBaseHealth * creatureTemplate->ModHealth;
-
-            // allows health to be different with creatures that originally
-            // differentiate their health by different level instead of multiplier field.
-            // expecially in dungeons. The health reduction decrease if original level is similar to the area max level
-            if (originalLevel >= areaMinLvl && originalLevel < areaMaxLvl) {
-                float reduction = newHealth / float(areaMaxLvl-areaMinLvl) * (float(areaMaxLvl-originalLevel)*0.3f); // never more than 30%
-                if (reduction > 0 && reduction < newHealth)
-                    newHealth -= reduction;
-            }
+            if (!resetSelLevel && QueueAsyncRescale(mapABInfo, creature, creatureABInfo, creatureTemplate, cacheKey, levelChanged))
+                return;
 
-            hpStatsRate = newHealth / float(baseHealth);
+            stats = ComputeCachedStats(config, creatureTemplate, creatureOverride, cacheKey);
         }
 
-        creatureABInfo->HealthMultiplier *= hpStatsRate;
-
-        scaledHealth = round(((float) baseHealth * creatureABInfo->HealthMultiplier) + 1.0f);
-
-        //Getting the list of Classes in this group - this will be used later on to determine what additional scaling will be required based on the ratio of tank/dps/healer
-        //GetPlayerClassList(creature, playerClassList); // Update playerClassList with the list of all the participating Classes
+        ApplyScaledStats(mapABInfo, creature, creatureABInfo, stats, creatureABInfo->instancePlayerCount, defaultMultiplier, levelChanged);
+    }
+};
 
-        float manaStatsRate  = 1.0f;
-        if (!useDefStats && LevelScaling && !skipLevel) {
-            float newMana =  creatureStats->GenerateMana(creatureTemplate);
-            manaStatsRate = newMana/float(baseMana);
-        }
+// Microbenchmarks of the per-creature hot paths, run by the bench command. They work on
+// synthetic map and creature info, so no live object is touched, and print one CSV line
+// (AB_BENCH,case,players,iterations,ns_per_op) per case and map shape.
+class ABBenchmark
+{
+public:
+    explicit ABBenchmark(uint32 iterations) : _iterations(iterations) {}
 
-        creatureABInfo->ManaMultiplier =  manaStatsRate * manaMultiplier * defaultMultiplier * globalRate;
+    std::vector<std::string> Run()
+    {
+        ABConfig const& config = GetConfig();
+        static uint32 const shapes[] = { 5, 10, 25, 40 };
 
-        if (creatureABInfo->ManaMultiplier <= MinManaModifier)
+        std::vector<std::string> results;
+        for (uint32 maxPlayers : shapes)
         {
-            creatureABInfo->ManaMultiplier = MinManaModifier;
-        }
-
-        scaledMana = round(baseMana * creatureABInfo->ManaMultiplier);
-
-        float damageMul = defaultMultiplier * globalRate * damageMultiplier;
+            AutoBalanceMapInfo mapInfo;
+            mapInfo.context.isDungeon = true;
+            mapInfo.context.isRaid = maxPlayers > 5;
+            mapInfo.context.maxPlayers = maxPlayers;
+            mapInfo.context.inflectionBucket = GetInflectionBucket(mapInfo.context.isRaid, false, maxPlayers);
+            mapInfo.SetPlayerCount(maxPlayers / 2);
+            mapInfo.SetMapLevel(80);
+
+            // a pool populated like a dungeon, less than one slab so no map is needed
+            for (uint64 guid = 1; guid <= 200; ++guid)
+                mapInfo.creatures.Create(guid, nullptr);
+
+            uint64 const creatureGuid = 100;
+            AutoBalanceCreatureInfo* creatureInfo = mapInfo.creatures.Find(creatureGuid);
+            creatureInfo->scaled = true;
+            creatureInfo->generation = GetScalingGeneration(&mapInfo);
+            creatureInfo->DamageMultiplier = config.curve.Get(mapInfo.context.inflectionBucket, false, maxPlayers, maxPlayers / 2);
+
+            ABInflectionBucket bucket = mapInfo.context.inflectionBucket;
+            results.push_back(Format("scaling_curve", maxPlayers, Measure([&config, bucket, maxPlayers](uint32 i)
+            {
+                return uint32(config.curve.Get(bucket, i & 1, maxPlayers, 1 + i % (maxPlayers - 1)) * 1000.0f);
+            })));
 
-        // Can not be less then Min_D_Mod
-        if (damageMul <= MinDamageModifier)
-        {
-            damageMul = MinDamageModifier;
-        }
+            // the stat math of a rescale, without the Creature setters
+            ABScalingInput input = GoldenCases[2].input;
+            results.push_back(Format("rescale_kernel", maxPlayers, Measure([&config, &input, bucket, maxPlayers](uint32 i)
+            {
+                input.defaultMultiplier = config.curve.Get(bucket, false, maxPlayers, 1 + i % (maxPlayers - 1));
+                return ComputeScaledStats(input, config.scaling).health;
+            })));
 
-        if (!useDefStats && LevelScaling && !skipLevel) {
-            float origDmgBase = origCreatureStats->GenerateBaseDamage(creatureTemplate);
-            float newDmgBase = 0;
-            if (level <= 60)
-                newDmgBase=creatureStats->BaseDamage[0];
-            else if(level <= 70)
-                newDmgBase=creatureStats->BaseDamage[1];
-            else {
-                newDmgBase=creatureStats->BaseDamage[2];
-                // special increasing for end-game contents
-                if (LevelEndGameBoost && !creature->GetMap()->IsRaid())
-                    newDmgBase *= creatureABInfo->selectedLevel >= 75 && originalLevel < 75 ? float(creatureABInfo->selectedLevel-70) * 0.3f : 1;
+            // the same with the kernel the config snapshot has selected for these settings
+            results.push_back(Format("rescale_kernel_specialized", maxPlayers, Measure([&config, &input, bucket, maxPlayers](uint32 i)
+            {
+                input.defaultMultiplier = config.curve.Get(bucket, false, maxPlayers, 1 + i % (maxPlayers - 1));
+                return config.statsKernels[GetStatsKernelIndex(input)](input, config.scaling).health;
+            })));
+
+            // the same rescale answered by the stats cache, filled with every player count of the shape
+            ABStatsCache cache;
+            cache.Init(4096);
+            ABStatsKey cacheKey = {};
+            cacheKey.entry = 1;
+            cacheKey.selectedLevel = input.selectedLevel;
+            cacheKey.mapLevel = input.mapLevel;
+            for (uint32 count = 1; count < maxPlayers; ++count)
+            {
+                input.defaultMultiplier = cacheKey.defaultMultiplier = config.curve.Get(bucket, false, maxPlayers, count);
+                cache.Store(cacheKey, ComputeScaledStats(input, config.scaling));
             }
 
-            damageMul *= newDmgBase/origDmgBase;
-        }
+            results.push_back(Format("stats_cache_hit", maxPlayers, Measure([&config, &cache, cacheKey, bucket, maxPlayers](uint32 i)
+            {
+                ABStatsKey key = cacheKey;
+                key.defaultMultiplier = config.curve.Get(bucket, false, maxPlayers, 1 + i % (maxPlayers - 1));
 
-        creatureABInfo->ArmorMultiplier = globalRate * armorMultiplier;
-        uint32 newBaseArmor= round(creatureABInfo->ArmorMultiplier * (useDefStats || !LevelScaling || skipLevel ? origCreatureStats->GenerateArmor(creatureTemplate) : creatureStats->GenerateArmor(creatureTemplate)));
+                ABScaledStats stats;
+                return cache.Find(key, stats) ? stats.health : 0;
+            })));
 
-        if (!sABScriptMgr->OnBeforeUpdateStats(creature, scaledHealth, scaledMana, damageMul, newBaseArmor))
-            return;
+            // the early return of ModifyCreatureAttributes for a creature that is up to date
+            results.push_back(Format("noop_update", maxPlayers, Measure([&mapInfo, creatureGuid](uint32 /*i*/)
+            {
+                AutoBalanceCreatureInfo const* info = mapInfo.creatures.Find(creatureGuid);
+                return uint32(info && info->generation == GetScalingGeneration(&mapInfo));
+            })));
 
-        uint32 prevMaxHealth = creature->GetMaxHealth();
-        uint32 prevMaxPower = creature->GetMaxPower(POWER_MANA);
-        uint32 prevHealth = creature->GetHealth();
-        uint32 prevPower = creature->GetPower(POWER_MANA);
+            results.push_back(Format("damage_hook", maxPlayers, Measure([&mapInfo, creatureGuid](uint32 i)
+            {
+                uint32 damage = 1000 + (i & 1023);
+                AutoBalanceCreatureInfo const* info = mapInfo.creatures.Find(creatureGuid);
+                if (!info || !ScalesDamage(&mapInfo, info))
+                    return damage;
 
-        Powers pType= creature->getPowerType();
+                return uint32(damage * info->DamageMultiplier);
+            })));
+        }
 
-        creature->SetArmor(newBaseArmor);
-        creature->SetModifierValue(UNIT_MOD_ARMOR, BASE_VALUE, (float)newBaseArmor);
-        creature->SetCreateHealth(scaledHealth);
-        creature->SetMaxHealth(scaledHealth);
-        creature->ResetPlayerDamageReq();
-        creature->SetCreateMana(scaledMana);
-        creature->SetMaxPower(POWER_MANA, scaledMana);
-        creature->SetModifierValue(UNIT_MOD_ENERGY, BASE_VALUE, (float)100.0f);
-        creature->SetModifierValue(UNIT_MOD_RAGE, BASE_VALUE, (float)100.0f);
-        creature->SetModifierValue(UNIT_MOD_HEALTH, BASE_VALUE, (float)scaledHealth);
-        creature->SetModifierValue(UNIT_MOD_MANA, BASE_VALUE, (float)scaledMana);
-        creatureABInfo->DamageMultiplier = damageMul;
+        // a mix of configured and unknown entries, independent of the map shape
+        std::vector<uint32> entries(1024);
+        uint32 seed = 12345;
+        for (uint32& entry : entries)
+        {
+            seed = seed * 1103515245 + 12345;
+            entry = 1 + (seed >> 8) % 40000;
+        }
 
-        uint32 scaledCurHealth=prevHealth && prevMaxHealth ? float(scaledHealth)/float(prevMaxHealth)*float(prevHealth) : 0;
-        uint32 scaledCurPower=prevPower && prevMaxPower  ? float(scaledMana)/float(prevMaxPower)*float(prevPower) : 0;
+        results.push_back(Format("override_lookup", 0, Measure([&config, &entries](uint32 i)
+        {
+            ABCreatureOverride const* creatureOverride = config.creatureOverrides.Find(entries[i & 1023]);
+            return uint32(creatureOverride ? creatureOverride->forcedPlayerCount : 0);
+        })));
 
-        creature->SetHealth(scaledCurHealth);
-        if (pType == POWER_MANA)
-            creature->SetPower(POWER_MANA, scaledCurPower);
-        else
-            creature->setPowerType(pType); // fix creatures with different power types
+        return results;
+    }
 
-        creature->UpdateAllStats();
+private:
+    template<class Op>
+    double Measure(Op op)
+    {
+        uint32 sink = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (uint32 i = 0; i < _iterations; ++i)
+            sink += op(i);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+        // keeps the compiler from dropping the loop
+        _sink = sink;
+        return elapsed.count() / _iterations;
+    }
+
+    std::string Format(char const* name, uint32 players, double nsPerOp) const
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "AB_BENCH,%s,%u,%u,%.2f", name, players, _iterations, nsPerOp);
+        return line;
     }
+
+    uint32 _iterations;
+    volatile uint32 _sink = 0;
 };
+
 class AutoBalance_CommandScript : public CommandScript
 {
 public:
@@ -975,6 +4918,13 @@ public:
             { "checkmap",         SEC_GAMEMASTER,                        true, &HandleABCheckMapCommand,                  "Run a check for current map/instance, it can help in case you're testing autobalance with GM." },
             { "mapstat",          SEC_GAMEMASTER,                        true, &HandleABMapStatsCommand,                  "Shows current autobalance information for this map-" },
             { "creaturestat",     SEC_GAMEMASTER,                        true, &HandleABCreatureStatsCommand,             "Shows current autobalance information for selected creature." },
+            { "hookstats",        SEC_GAMEMASTER,                        true, &HandleABHookStatsCommand,                 "Shows how many creature updates were short-circuited and how many stat fields the rescales skipped (needs AutoBalance.HookStats = 1). Use 'reset' to clear the counters." },
+            { "reloadstats",      SEC_GAMEMASTER,                        true, &HandleABReloadStatsCommand,               "Shows what the last config reload changed and how many creatures and maps it has been applied to so far." },
+            { "perf",             SEC_GAMEMASTER,                        true, &HandleABPerfCommand,                      "Shows the AutoBalance call counts and latencies of all threads and of the selected player's map (needs AutoBalance.Perf.Enable = 1). Use 'reset' to clear the counters." },
+            { "trace",            SEC_ADMINISTRATOR,                     true, &HandleABTraceCommand,                     "Records the rescales, roster changes, stat updates and notifications of one or all maps to a Chrome trace file. Syntax: .autobalance trace [start [all|here|map id]|stop]" },
+            { "statscache",       SEC_GAMEMASTER,                        true, &HandleABStatsCacheCommand,                "Shows the size and hit rate of the shared scaled stats cache. Use 'reset' to clear the counters." },
+            { "selftest",         SEC_GAMEMASTER,                        true, &HandleABSelfTestCommand,                  "Checks the stat scaling against its golden values, bit exact unless a relative tolerance is given. Syntax: .autobalance selftest [tolerance]" },
+            { "bench",            SEC_ADMINISTRATOR,                     true, &HandleABBenchCommand,                     "Runs the AutoBalance microbenchmarks and prints CSV results (AB_BENCH,case,players,iterations,ns_per_op). Blocks the world thread while running. Syntax: .autobalance bench [iterations]" },
         };
 
         static std::vector<ChatCommand> commandTable =
@@ -999,7 +4949,10 @@ public:
         {
             offseti = (uint32)atoi(offset);
             handler->PSendSysMessage("Changing Player Difficulty Offset to %i.", offseti);
-            PlayerCountDifficultyOffset = offseti;
+            // published as a modified copy, readers keep the snapshot they already hold
+            std::unique_ptr<ABConfig> config(new ABConfig(GetConfig()));
+            config->PlayerCountDifficultyOffset = offseti;
+            PublishConfig(std::move(config));
             return true;
         }
         else
@@ -1009,7 +4962,8 @@ public:
 
     static bool HandleABGetOffsetCommand(ChatHandler* handler, const char* /*args*/)
     {
-        handler->PSendSysMessage("Current Player Difficulty Offset = %i", PlayerCountDifficultyOffset);
+        ABConfig const& config = GetConfig();
+        handler->PSendSysMessage("Current Player Difficulty Offset = %i", config.PlayerCountDifficultyOffset);
         return true;
     }
 
@@ -1024,23 +4978,15 @@ public:
             return false;
         }
 
-        AutoBalanceMapInfo *mapABInfo=pl->GetMap()->CustomData.GetDefault<AutoBalanceMapInfo>("AutoBalanceMapInfo");
+        AutoBalanceMapInfo *mapABInfo=GetMapInfo(pl->GetMap());
 
-        mapABInfo->playerCount = pl->GetMap()->GetPlayersCountExceptGMs();
+        // the only full walk left, it also picks up GM mode toggles that happened
+        // without any other roster event
+        mapABInfo->roster.Rebuild(pl->GetMap());
+        mapABInfo->SetPlayerCount(mapABInfo->roster.GetPlayerCount());
 
-        Map::PlayerList const &playerList = pl->GetMap()->GetPlayers();
-        uint8 level = 0;
-        if (!playerList.isEmpty())
-        {
-            for (Map::PlayerList::const_iterator playerIteration = playerList.begin(); playerIteration != playerList.end(); ++playerIteration)
-            {
-                if (Player* playerHandle = playerIteration->GetSource())
-                {
-                    if (playerHandle->getLevel() > level)
-                        mapABInfo->mapLevel = level = playerHandle->getLevel();
-                }
-            }
-        }
+        if (uint8 level = mapABInfo->roster.GetMaxLevel())
+            mapABInfo->SetMapLevel(level);
 
         HandleABMapStatsCommand(handler, args);
 
@@ -1058,10 +5004,24 @@ public:
             return false;
         }
 
-        AutoBalanceMapInfo *mapABInfo=pl->GetMap()->CustomData.GetDefault<AutoBalanceMapInfo>("AutoBalanceMapInfo");
+        AutoBalanceMapInfo *mapABInfo=GetMapInfo(pl->GetMap());
 
         handler->PSendSysMessage("Players on map: %u", mapABInfo->playerCount);
         handler->PSendSysMessage("Max level of players in this map: %u", mapABInfo->mapLevel);
+        handler->PSendSysMessage("Players in combat: %u", mapABInfo->roster.GetInCombatCount());
+        handler->PSendSysMessage("Median player level: %u", mapABInfo->roster.GetLevelPercentile(50));
+        handler->PSendSysMessage("Scaling generation: %u", GetScalingGeneration(mapABInfo));
+
+        ABRescaleBudget const& budget = mapABInfo->rescaleBudget;
+        handler->PSendSysMessage("Rescale backlog: %u creatures (peak %u)%s", budget.backlog, budget.peakBacklog, budget.IsInWave() ? ", rescale in progress" : "");
+        handler->PSendSysMessage("Last full rescale: %u creatures in %u ms over %u map updates", budget.lastWaveCreatures, budget.lastWaveDuration, budget.lastWaveUpdates);
+
+        ABCreaturePool const& creatures = mapABInfo->creatures;
+        handler->PSendSysMessage("Scaled creature entries: %u of %u, %u KB", creatures.GetUsed(), creatures.GetCapacity(), uint32(creatures.GetMemoryUsage() / 1024));
+        handler->PSendSysMessage("All maps: %u entries, %u KB", CreaturePoolEntries.load(std::memory_order_relaxed),
+            uint32(CreaturePoolBytes.load(std::memory_order_relaxed) / 1024));
+        handler->PSendSysMessage("Asynchronous rescales: %llu queued, %llu applied, %llu outdated", (unsigned long long)AsyncRescaleStats.queued.load(std::memory_order_relaxed),
+            (unsigned long long)AsyncRescaleStats.applied.load(std::memory_order_relaxed), (unsigned long long)AsyncRescaleStats.outdated.load(std::memory_order_relaxed));
 
         return true;
     }
@@ -1077,10 +5037,18 @@ public:
             return false;
         }
 
-        AutoBalanceCreatureInfo *creatureABInfo=target->CustomData.GetDefault<AutoBalanceCreatureInfo>("AutoBalanceCreatureInfo");
+        AutoBalanceMapInfo const* mapABInfo = MapInfoKey.Find(target->GetMap()->CustomData);
+        AutoBalanceCreatureInfo const* creatureABInfo = mapABInfo ? mapABInfo->creatures.Find(target->GetGUID()) : nullptr;
+
+        if (!creatureABInfo)
+        {
+            handler->PSendSysMessage("Creature has not been evaluated by AutoBalance.");
+            return true;
+        }
 
         handler->PSendSysMessage("Instance player Count: %u", creatureABInfo->instancePlayerCount);
         handler->PSendSysMessage("Selected level: %u", creatureABInfo->selectedLevel);
+        handler->PSendSysMessage("Scaling generation: %u", creatureABInfo->generation);
         handler->PSendSysMessage("Damage multiplier: %.6f", creatureABInfo->DamageMultiplier);
         handler->PSendSysMessage("Health multiplier: %.6f", creatureABInfo->HealthMultiplier);
         handler->PSendSysMessage("Mana multiplier: %.6f", creatureABInfo->ManaMultiplier);
@@ -1089,6 +5057,243 @@ public:
         return true;
 
     }
+
+    static bool HandleABPerfCommand(ChatHandler* handler, const char* args)
+    {
+        ABConfig const& config = GetConfig();
+        if (!config.PerfEnabled)
+            handler->PSendSysMessage("AutoBalance.Perf.Enable is disabled, the counters are not updated.");
+
+        Player* player = handler->getSelectedPlayer();
+        AutoBalanceMapInfo* mapABInfo = player && player->GetMap() ? MapInfoKey.Find(player->GetMap()->CustomData) : nullptr;
+
+        if (args && strcmp(args, "reset") == 0)
+        {
+            Perf.Reset();
+            if (mapABInfo)
+                mapABInfo->perf.Reset();
+
+            handler->PSendSysMessage("Perf counters reset.");
+            return true;
+        }
+
+        ABPerfValues values = Perf.Collect();
+        uint64 calls = values.counters[AB_PERF_MODIFY_CALLS];
+        uint64 rescales = values.counters[AB_PERF_RESCALES];
+
+        handler->PSendSysMessage("All maps (%u threads):", Perf.GetThreadCount());
+        handler->PSendSysMessage("Creature updates: %llu, early out: %llu, full rescales: %llu", (unsigned long long)calls,
+            (unsigned long long)(calls - std::min(calls, rescales)), (unsigned long long)rescales);
+        handler->PSendSysMessage("Damage hooks: %llu, modified: %llu, immunities applied: %llu, notifications sent: %llu, script hooks: %llu",
+            (unsigned long long)values.counters[AB_PERF_DAMAGE_CALLS], (unsigned long long)values.counters[AB_PERF_DAMAGE_MODIFIED],
+            (unsigned long long)values.counters[AB_PERF_IMMUNITIES], (unsigned long long)values.counters[AB_PERF_NOTIFICATIONS],
+            (unsigned long long)values.counters[AB_PERF_HOOK_DISPATCHES]);
+
+        for (uint32 timer = 0; timer < MAX_AB_PERF_TIMERS; ++timer)
+        {
+            uint64 count = values.timeCount[timer];
+            handler->PSendSysMessage("%s: %llu times, avg %llu ns, p50 < %llu ns, p99 < %llu ns, total %llu us", PerfTimerNames[timer][0], (unsigned long long)count,
+                (unsigned long long)(count ? values.timeSum[timer] / count : 0), (unsigned long long)values.GetPercentile(ABPerfTimer(timer), 50),
+                (unsigned long long)values.GetPercentile(ABPerfTimer(timer), 99), (unsigned long long)(values.timeSum[timer] / 1000));
+        }
+
+        if (!mapABInfo)
+            return true;
+
+        ABPerfMapStats const& mapStats = mapABInfo->perf;
+        calls = mapStats.counters[AB_PERF_MODIFY_CALLS].load(std::memory_order_relaxed);
+        rescales = mapStats.counters[AB_PERF_RESCALES].load(std::memory_order_relaxed);
+
+        handler->PSendSysMessage("Map %s:", player->GetMap()->GetMapName());
+        handler->PSendSysMessage("Creature updates: %llu, early out: %llu, full rescales: %llu, rescale time %llu us, apply time %llu us", (unsigned long long)calls,
+            (unsigned long long)(calls - std::min(calls, rescales)), (unsigned long long)rescales,
+            (unsigned long long)(mapStats.timeSum[AB_PERF_TIME_RESCALE].load(std::memory_order_relaxed) / 1000),
+            (unsigned long long)(mapStats.timeSum[AB_PERF_TIME_APPLY].load(std::memory_order_relaxed) / 1000));
+        handler->PSendSysMessage("Damage hooks: %llu, modified: %llu, immunities applied: %llu, notifications sent: %llu",
+            (unsigned long long)mapStats.counters[AB_PERF_DAMAGE_CALLS].load(std::memory_order_relaxed),
+            (unsigned long long)mapStats.counters[AB_PERF_DAMAGE_MODIFIED].load(std::memory_order_relaxed),
+            (unsigned long long)mapStats.counters[AB_PERF_IMMUNITIES].load(std::memory_order_relaxed),
+            (unsigned long long)mapStats.counters[AB_PERF_NOTIFICATIONS].load(std::memory_order_relaxed));
+
+        return true;
+    }
+
+    static bool HandleABTraceCommand(ChatHandler* handler, const char* args)
+    {
+        std::vector<std::string> tokens = SplitConfigTokens(args ? args : "", ' ');
+        std::string const& action = tokens[0];
+
+        if (action == "start")
+        {
+            // repeated spaces leave empty tokens
+            uint32 mapId = AB_TRACE_ALL_MAPS;
+            auto targetToken = std::find_if(tokens.begin() + 1, tokens.end(), [](std::string const& token) { return !token.empty(); });
+            std::string target = targetToken != tokens.end() ? *targetToken : "all";
+            if (target == "here")
+            {
+                Player* player = handler->getSelectedPlayer();
+                if (!player)
+                {
+                    handler->SendSysMessage(LANG_SELECT_PLAYER_OR_PET);
+                    handler->SetSentErrorMessage(true);
+                    return false;
+                }
+
+                mapId = player->GetMapId();
+            }
+            else if (target != "all")
+            {
+                char* end = nullptr;
+                unsigned long id = strtoul(target.c_str(), &end, 10);
+                if (!isdigit(uint8(target[0])) || *end || !ABTraceRecorder::IsValidMapId(id))
+                {
+                    handler->PSendSysMessage("Unknown trace target '%s', use all, here or a map id.", target.c_str());
+                    handler->SetSentErrorMessage(true);
+                    return false;
+                }
+
+                mapId = uint32(id);
+            }
+
+            ABConfig const& config = GetConfig();
+            char fileName[64];
+            snprintf(fileName, sizeof(fileName), "autobalance_trace_%llu.json", (unsigned long long)time(nullptr));
+            std::string path = config.TraceDirectory.empty() ? fileName : config.TraceDirectory + "/" + fileName;
+
+            std::string error;
+            if (!TraceRecorder.Start(mapId, config.TraceBufferSize, path, error))
+            {
+                handler->PSendSysMessage("Could not start the trace: %s.", error.c_str());
+                handler->SetSentErrorMessage(true);
+                return false;
+            }
+
+            if (mapId == AB_TRACE_ALL_MAPS)
+                handler->PSendSysMessage("Tracing all maps to %s (%u events buffered).", path.c_str(), TraceRecorder.GetBufferSize());
+            else
+                handler->PSendSysMessage("Tracing map %u to %s (%u events buffered).", mapId, path.c_str(), TraceRecorder.GetBufferSize());
+            return true;
+        }
+
+        if (action == "stop")
+        {
+            TraceRecorder.Stop();
+            handler->PSendSysMessage("Trace stopped, the rest of %s is written in the background.", TraceRecorder.GetFileName().c_str());
+            return true;
+        }
+
+        uint32 filter = TraceRecorder.GetFilter();
+        if (filter == AB_TRACE_ALL_MAPS)
+            handler->PSendSysMessage("Tracing all maps to %s.", TraceRecorder.GetFileName().c_str());
+        else if (TraceRecorder.IsRecording(filter))
+            handler->PSendSysMessage("Tracing map %u to %s.", filter, TraceRecorder.GetFileName().c_str());
+        else
+            handler->PSendSysMessage("Not tracing%s.", TraceRecorder.IsWriting() ? ", the last trace is still being written" : "");
+
+        handler->PSendSysMessage("Events written: %llu, dropped because the buffer was full: %llu", (unsigned long long)TraceRecorder.written.load(std::memory_order_relaxed),
+            (unsigned long long)TraceRecorder.dropped.load(std::memory_order_relaxed));
+        return true;
+    }
+
+    static bool HandleABHookStatsCommand(ChatHandler* handler, const char* args)
+    {
+        ABConfig const& config = GetConfig();
+        if (!config.HookStatsEnabled)
+            handler->PSendSysMessage("AutoBalance.HookStats is disabled, the counters are not updated.");
+
+        if (args && strcmp(args, "reset") == 0)
+        {
+            HookStats.Reset();
+            handler->PSendSysMessage("Creature update counters reset.");
+            return true;
+        }
+
+        uint64 updates = HookStats.updates.load(std::memory_order_relaxed);
+        uint64 unscaledMap = HookStats.unscaledMap.load(std::memory_order_relaxed);
+        uint64 upToDate = HookStats.upToDate.load(std::memory_order_relaxed);
+        double total = updates ? double(updates) : 1.0;
+
+        handler->PSendSysMessage("Creature updates: %llu", (unsigned long long)updates);
+        handler->PSendSysMessage("Skipped on unscaled maps: %llu (%.2f%%)", (unsigned long long)unscaledMap, unscaledMap * 100.0 / total);
+        handler->PSendSysMessage("Skipped as already scaled: %llu (%.2f%%)", (unsigned long long)upToDate, upToDate * 100.0 / total);
+        handler->PSendSysMessage("Reached the scaling checks: %llu", (unsigned long long)(updates - std::min(updates, unscaledMap + upToDate)));
+
+        uint64 appliedFields = HookStats.appliedFields.load(std::memory_order_relaxed);
+        uint64 skippedFields = HookStats.skippedFields.load(std::memory_order_relaxed);
+        handler->PSendSysMessage("Rescaled health/mana/armor fields set: %llu, unchanged and skipped: %llu", (unsigned long long)appliedFields, (unsigned long long)skippedFields);
+        handler->PSendSysMessage("UpdateAllStats calls: %llu, skipped: %llu", (unsigned long long)HookStats.statUpdates.load(std::memory_order_relaxed),
+            (unsigned long long)HookStats.skippedStatUpdates.load(std::memory_order_relaxed));
+
+        return true;
+    }
+
+    static bool HandleABReloadStatsCommand(ChatHandler* handler, const char* /*args*/)
+    {
+        ABConfig const& config = GetConfig();
+        handler->PSendSysMessage("Config generation %u changed %s.", config.generation, config.changes.c_str());
+        handler->PSendSysMessage("Creatures rescaled since: %u", ReloadStats.rescaledCreatures.load(std::memory_order_relaxed));
+        handler->PSendSysMessage("Dungeon maps with reapplied immunities: %u, still pending: %u", ReloadStats.immunityMaps.load(std::memory_order_relaxed),
+            PendingImmunityReloads.load(std::memory_order_relaxed));
+        return true;
+    }
+
+    static bool HandleABStatsCacheCommand(ChatHandler* handler, const char* args)
+    {
+        if (args && strcmp(args, "reset") == 0)
+        {
+            StatsCache.ResetStats();
+            handler->PSendSysMessage("Stats cache counters reset.");
+            return true;
+        }
+
+        if (!StatsCache.IsEnabled())
+        {
+            handler->PSendSysMessage("The stats cache is disabled (AutoBalance.StatsCache.Size = 0).");
+            return true;
+        }
+
+        uint64 hits, misses, stores;
+        StatsCache.GetStats(hits, misses, stores);
+        handler->PSendSysMessage("Stats cache: %u slots, %u KB", StatsCache.GetSize(), uint32(StatsCache.GetMemoryUsage() / 1024));
+        handler->PSendSysMessage("Hits: %llu, misses: %llu (hit rate %.2f%%), results stored: %llu", (unsigned long long)hits, (unsigned long long)misses,
+            hits * 100.0 / double(std::max<uint64>(hits + misses, 1)), (unsigned long long)stores);
+        handler->PSendSysMessage("Precomputed instances: %u, results: %u, last instance took %u us", PrecomputeWorker.jobs.load(std::memory_order_relaxed),
+            PrecomputeWorker.results.load(std::memory_order_relaxed), PrecomputeWorker.lastJobMicroseconds.load(std::memory_order_relaxed));
+        return true;
+    }
+
+    static bool HandleABSelfTestCommand(ChatHandler* handler, const char* args)
+    {
+        float tolerance = 0.0f;
+        if (args && *args)
+            tolerance = std::max(0.0f, float(atof(args)));
+
+        std::vector<std::string> failures = RunScalingSelfTest(tolerance);
+        for (std::string const& failure : failures)
+            handler->SendSysMessage(failure.c_str());
+
+        handler->PSendSysMessage("%u of %u golden cases passed (tolerance %g).", uint32(sizeof(GoldenCases) / sizeof(GoldenCases[0]) - failures.size()),
+            uint32(sizeof(GoldenCases) / sizeof(GoldenCases[0])), tolerance);
+
+        return true;
+    }
+
+    static bool HandleABBenchCommand(ChatHandler* handler, const char* args)
+    {
+        uint32 iterations = 1000000;
+        if (args && *args)
+            iterations = uint32(std::min(std::max(atoi(args), 1000), 100000000));
+
+        ABBenchmark benchmark(iterations);
+        for (std::string const& line : benchmark.Run())
+        {
+            handler->SendSysMessage(line.c_str());
+            // in the server log as well, so runs can be collected and compared
+            sLog->outString("%s", line.c_str());
+        }
+
+        return true;
+    }
 };
 
 class AutoBalance_GlobalScript : public GlobalScript {
@@ -1099,19 +5304,20 @@ public:
         //if (!dungeonCompleted)
         //    return;
 
-        if (!rewardEnabled || !updated)
+        ABConfig const& config = GetConfig();
+        if (!config.rewardEnabled || !updated)
             return;
 
-        if (map->GetPlayersCountExceptGMs() < MinPlayerReward)
-            return;
+        AutoBalanceMapInfo *mapABInfo=GetMapInfo(map);
 
-        AutoBalanceMapInfo *mapABInfo=map->CustomData.GetDefault<AutoBalanceMapInfo>("AutoBalanceMapInfo");
+        if (mapABInfo->roster.GetPlayerCount() < config.MinPlayerReward)
+            return;
 
         uint8 areaMinLvl, areaMaxLvl;
-        getAreaLevel(map, source->GetAreaId(), areaMinLvl, areaMaxLvl);
+        mapABInfo->context.GetAreaLevel(source->GetAreaId(), areaMinLvl, areaMaxLvl);
 
         // skip if it's not a pre-wotlk dungeon/raid and if it's not scaled
-        if (!LevelScaling || lowerOffset >= 10 || mapABInfo->mapLevel <= 70 || areaMinLvl > 70
+        if (!config.LevelScaling || config.lowerOffset >= 10 || mapABInfo->mapLevel <= 70 || areaMinLvl > 70
             // skip when not in dungeon or not kill credit
             || type != ENCOUNTER_CREDIT_KILL_CREATURE || !map->IsDungeon())
             return;
@@ -1121,7 +5327,7 @@ public:
         if (playerList.isEmpty())
             return;
 
-        uint32 reward = map->IsRaid() ? rewardRaid : rewardDungeon;
+        uint32 reward = map->IsRaid() ? config.rewardRaid : config.rewardDungeon;
         if (!reward)
             return;
 
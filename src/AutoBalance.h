@@ -4,20 +4,75 @@
 #include "ScriptMgr.h"
 #include "Creature.h"
 
+#include <vector>
+
+class ABModuleScript;
+
+// The hooks of an ABModuleScript, a script passes the ones it implements to the
+// ABModuleScript constructor and is only called for those
+enum ABHook
+{
+    AB_HOOK_BEFORE_MODIFY_ATTRIBUTES = 0,
+    AB_HOOK_AFTER_DEFAULT_MULTIPLIER,
+    AB_HOOK_BEFORE_UPDATE_STATS,
+    AB_HOOK_COUNT
+};
+
+enum ABHookMask
+{
+    AB_HOOK_MASK_BEFORE_MODIFY_ATTRIBUTES = 1 << AB_HOOK_BEFORE_MODIFY_ATTRIBUTES,
+    AB_HOOK_MASK_AFTER_DEFAULT_MULTIPLIER = 1 << AB_HOOK_AFTER_DEFAULT_MULTIPLIER,
+    AB_HOOK_MASK_BEFORE_UPDATE_STATS      = 1 << AB_HOOK_BEFORE_UPDATE_STATS,
+    AB_HOOK_MASK_ALL                      = (1 << AB_HOOK_COUNT) - 1
+};
+
+// The values of one creature rescale, each hook may change the ones of its stage
+struct ABScalingContext
+{
+    Creature* creature = nullptr;
+    // OnScalingStart
+    uint32 instancePlayerCount = 0;
+    // OnScalingMultiplier
+    float defaultMultiplier = 1.0f;
+    // OnScalingStats
+    uint32 scaledHealth = 0;
+    uint32 scaledMana = 0;
+    float damageMultiplier = 1.0f;
+    uint32 newBaseArmor = 0;
+};
+
 // Manages registration, loading, and execution of scripts.
 class ABScriptMgr
 {
     friend class ACE_Singleton<ABScriptMgr, ACE_Null_Mutex>;
     public: /* Initialization */
 
+        // called by the ABModuleScript constructor
+        void AddScript(ABModuleScript* script, uint32 hooks);
+
+        bool HasScripts(ABHook hook) const { return !_scripts[hook].empty(); }
+
+        // The hooks below return false if at least one script did, all scripts are
+        // called regardless. Without a script for the hook they cost a single branch.
+
         // called at the start of ModifyCreatureAttributes method
         // it can be used to add some condition to skip autobalancing system for example
-        bool OnBeforeModifyAttributes(Creature* creature, uint32 & instancePlayerCount);
+        bool OnScalingStart(ABScalingContext& context) { return !HasScripts(AB_HOOK_BEFORE_MODIFY_ATTRIBUTES) || Dispatch(AB_HOOK_BEFORE_MODIFY_ATTRIBUTES, context); }
         // called right after default multiplier has been set, you can use it to change
         // current scaling formula based on number of players or just skip modifications
-        bool OnAfterDefaultMultiplier(Creature* creature, float &defaultMultiplier);
+        bool OnScalingMultiplier(ABScalingContext& context) { return !HasScripts(AB_HOOK_AFTER_DEFAULT_MULTIPLIER) || Dispatch(AB_HOOK_AFTER_DEFAULT_MULTIPLIER, context); }
         // called before change creature values, to tune some values or skip modifications
+        bool OnScalingStats(ABScalingContext& context) { return !HasScripts(AB_HOOK_BEFORE_UPDATE_STATS) || Dispatch(AB_HOOK_BEFORE_UPDATE_STATS, context); }
+
+        // previous interface, kept for callers outside of this module
+        bool OnBeforeModifyAttributes(Creature* creature, uint32 & instancePlayerCount);
+        bool OnAfterDefaultMultiplier(Creature* creature, float &defaultMultiplier);
         bool OnBeforeUpdateStats(Creature* creature, uint32 &scaledHealth, uint32 &scaledMana, float &damageMultiplier, uint32 &newBaseArmor);
+
+    private:
+        bool Dispatch(ABHook hook, ABScalingContext& context);
+
+        std::vector<ABModuleScript*> _scripts[AB_HOOK_COUNT];
 };
 
 #define sABScriptMgr ACE_Singleton<ABScriptMgr, ACE_Null_Mutex>::instance()
@@ -25,14 +80,23 @@ class ABScriptMgr
 /*
 * Dedicated hooks for Autobalance Module
 * Can be used to extend/customize this system
+*
+* New scripts override the OnScaling* hooks and pass the matching AB_HOOK_MASK_* flags
+* to the constructor. Scripts overriding the previous three hooks keep working, the
+* default OnScaling* implementations forward to them. Those should pass the flags of
+* the hooks they override as well, the default is all of them.
 */
 class ABModuleScript : public ModuleScript
 {
     protected:
 
-        ABModuleScript(const char* name);
+        ABModuleScript(const char* name, uint32 hooks = AB_HOOK_MASK_ALL);
 
     public:
+        virtual bool OnScalingStart(ABScalingContext& context) { return OnBeforeModifyAttributes(context.creature, context.instancePlayerCount); }
+        virtual bool OnScalingMultiplier(ABScalingContext& context) { return OnAfterDefaultMultiplier(context.creature, context.defaultMultiplier); }
+        virtual bool OnScalingStats(ABScalingContext& context) { return OnBeforeUpdateStats(context.creature, context.scaledHealth, context.scaledMana, context.damageMultiplier, context.newBaseArmor); }
+
         virtual bool OnBeforeModifyAttributes(Creature* /*creature*/, uint32 & /*instancePlayerCount*/) { return true; }
         virtual bool OnAfterDefaultMultiplier(Creature* /*creature*/, float & /*defaultMultiplier*/) { return true; }
         virtual bool OnBeforeUpdateStats(Creature* /*creature*/, uint32 &/*scaledHealth*/, uint32 &/*scaledMana*/, float &/*damageMultiplier*/, uint32 &/*newBaseArmor*/) { return true; }